@@ -20,6 +20,7 @@
  */
 
 #include "NTPClient.h"
+#include "dns_cache.h"
 
 #ifndef LEAP_YEAR
 #  define LEAP_YEAR(Y)     ( (Y>0) && !(Y%4) && ( (Y%100) || !(Y%400) ) )
@@ -277,7 +278,14 @@ void NTPClient::sendNTPPacket() {
 
   // all NTP fields have been given values, now
   // you can send a packet requesting a timestamp:
-  this->_udp->beginPacket(this->_poolServerName, 123); //NTP requests are to port 123
+  // the address of the server is cached, rather than looked up every time.
+  IPAddress address;
+
+  if (DnsCache::resolve(this->_poolServerName, address)) {
+    this->_udp->beginPacket(address, 123); //NTP requests are to port 123
+  } else {
+    this->_udp->beginPacket(this->_poolServerName, 123);
+  }
   this->_udp->write(this->_packetBuffer, NTP_PACKET_SIZE);
   this->_udp->endPacket();
 }
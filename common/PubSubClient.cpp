@@ -6,10 +6,12 @@
 
 #include "PubSubClient.h"
 #include "Arduino.h"
+#include "dns_cache.h"
 
 PubSubClient::PubSubClient()
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     this->_client = NULL;
     this->stream = NULL;
     setCallback(NULL);
@@ -18,6 +20,7 @@ PubSubClient::PubSubClient()
 PubSubClient::PubSubClient(Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setClient(client);
     this->stream = NULL;
 }
@@ -25,6 +28,7 @@ PubSubClient::PubSubClient(Client& client)
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(addr, port);
     setClient(client);
     this->stream = NULL;
@@ -32,6 +36,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client)
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(addr, port);
     setClient(client);
     setStream(stream);
@@ -39,6 +44,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client, Stream
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(addr, port);
     setCallback(callback);
     setClient(client);
@@ -47,6 +53,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(addr, port);
     setCallback(callback);
     setClient(client);
@@ -56,6 +63,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(ip, port);
     setClient(client);
     this->stream = NULL;
@@ -63,6 +71,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client)
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(ip, port);
     setClient(client);
     setStream(stream);
@@ -70,6 +79,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& s
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(ip, port);
     setCallback(callback);
     setClient(client);
@@ -78,6 +88,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(ip, port);
     setCallback(callback);
     setClient(client);
@@ -87,6 +98,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
 PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(domain, port);
     setClient(client);
     this->stream = NULL;
@@ -94,6 +106,7 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client)
 PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(domain, port);
     setClient(client);
     setStream(stream);
@@ -101,6 +114,7 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client, St
 PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(domain, port);
     setCallback(callback);
     setClient(client);
@@ -109,12 +123,20 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
 PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(domain, port);
     setCallback(callback);
     setClient(client);
     setStream(stream);
 }
 
+PubSubClient::~PubSubClient()
+{
+    free(this->buffer);
+    freeInflight();
+    delete this->topics;
+}
+
 boolean PubSubClient::connect(const char *id)
 {
     return connect(id, NULL, NULL, 0, 0, 0, 0);
@@ -134,177 +156,287 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 {
     if (!connected())
     {
-        int result = 0;
+        if (sendConnect(id, user, pass, willTopic, willQos, willRetain, willMessage))
+        {
+            while (!_client->available())
+            {
+                unsigned long t = millis();
+
+                if (t - lastInActivity >= ((int32_t) MQTT_SOCKET_TIMEOUT * 1000UL))
+                {
+                    _state = MQTT_CONNECTION_TIMEOUT;
+                    _client->stop();
+                    return false;
+                }
+            }
+
+            return readConnack();
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+boolean PubSubClient::connectAsync(const char *id)
+{
+    return connectAsync(id, NULL, NULL, 0, 0, 0, 0);
+}
+
+boolean PubSubClient::connectAsync(const char *id, const char *user, const char *pass)
+{
+    return connectAsync(id, user, pass, 0, 0, 0, 0);
+}
+
+// Call repeatedly while disconnected.  Starts an attempt to connect once the
+// backoff since the last failure has passed, then checks for the CONNACK on
+// each later call, rather than waiting for it.  Returns true on the call
+// which completes the connection.
+boolean PubSubClient::connectAsync(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage)
+{
+    unsigned long t = millis();
 
-        if (domain != NULL)
+    if (_state == MQTT_CONNECTING)
+    {
+        if (_client->available())
+        {
+            if (readConnack())
+            {
+                return true;
+            }
+        }
+        else if (_client->connected() && t - lastInActivity < MQTT_SOCKET_TIMEOUT * 1000UL)
         {
-            result = _client->connect(this->domain, this->port);
+            return false;
         }
         else
         {
-            result = _client->connect(this->ip, this->port);
+            _state = MQTT_CONNECTION_TIMEOUT;
+            _client->stop();
         }
 
-        if (result == 1)
+        backoff();
+        return false;
+    }
+
+    if (connected())
+    {
+        return false;
+    }
+
+    if (connectFailures > 0 && t - connectAttempt < connectWait)
+    {
+        return false;
+    }
+
+    if (sendConnect(id, user, pass, willTopic, willQos, willRetain, willMessage))
+    {
+        _state = MQTT_CONNECTING;
+    }
+    else
+    {
+        backoff();
+    }
+
+    return false;
+}
+
+// Opens the connection and sends CONNECT, leaving the CONNACK to be read.
+boolean PubSubClient::sendConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage)
+{
+    int result = 0;
+
+    connectAttempt = millis();
+
+    if (domain != NULL)
+    {
+        // Use the cached address of the server, if we have one.
+        IPAddress address;
+
+        if (DnsCache::resolve(this->domain, address))
         {
-            nextMsgId = 1;
-            // Leave room in the buffer for header and variable length field
-            uint16_t length = 5;
-            unsigned int j;
+            result = _client->connect(address, this->port);
+        }
+    }
+    else
+    {
+        result = _client->connect(this->ip, this->port);
+    }
+
+    if (result == 1)
+    {
+        nextMsgId = 1;
+        // Leave room in the buffer for header and variable length field
+        uint16_t length = 5;
+        unsigned int j;
 
 #if MQTT_VERSION == MQTT_VERSION_3_1
-            uint8_t d[9] = {0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTT_VERSION};
+        uint8_t d[9] = {0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTT_VERSION};
 #define MQTT_HEADER_VERSION_LENGTH 9
 #elif MQTT_VERSION == MQTT_VERSION_3_1_1
-            uint8_t d[7] = {0x00, 0x04, 'M', 'Q', 'T', 'T', MQTT_VERSION};
+        uint8_t d[7] = {0x00, 0x04, 'M', 'Q', 'T', 'T', MQTT_VERSION};
 #define MQTT_HEADER_VERSION_LENGTH 7
 #endif
 
-            for (j = 0; j < MQTT_HEADER_VERSION_LENGTH; j++)
-            {
-                buffer[length++] = d[j];
-            }
+        for (j = 0; j < MQTT_HEADER_VERSION_LENGTH; j++)
+        {
+            buffer[length++] = d[j];
+        }
 
-            uint8_t v;
+        uint8_t v;
 
-            if (willTopic)
-            {
-                v = 0x06 | (willQos << 3) | (willRetain << 5);
-            }
-            else
+        if (willTopic)
+        {
+            v = 0x06 | (willQos << 3) | (willRetain << 5);
+        }
+        else
+        {
+            v = 0x02;
+        }
+
+        if (user != NULL)
+        {
+            v = v | 0x80;
+
+            if (pass != NULL)
             {
-                v = 0x02;
+                v = v | (0x80 >> 1);
             }
+        }
 
-            if (user != NULL)
-            {
-                v = v | 0x80;
+        buffer[length++] = v;
 
-                if (pass != NULL)
-                {
-                    v = v | (0x80 >> 1);
-                }
-            }
+        buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
+        buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
+        length = writeString(id, buffer, length);
 
-            buffer[length++] = v;
+        if (willTopic)
+        {
+            length = writeString(willTopic, buffer, length);
+            length = writeString(willMessage, buffer, length);
+        }
 
-            buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
-            buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
-            length = writeString(id, buffer, length);
+        if (user != NULL)
+        {
+            length = writeString(user, buffer, length);
 
-            if (willTopic)
+            if (pass != NULL)
             {
-                length = writeString(willTopic, buffer, length);
-                length = writeString(willMessage, buffer, length);
+                length = writeString(pass, buffer, length);
             }
+        }
 
-            if (user != NULL)
-            {
-                length = writeString(user, buffer, length);
+        write(MQTTCONNECT, buffer, length - 5);
 
-                if (pass != NULL)
-                {
-                    length = writeString(pass, buffer, length);
-                }
-            }
+        lastInActivity = lastOutActivity = millis();
+        return true;
+    }
 
-            write(MQTTCONNECT, buffer, length - 5);
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+}
 
-            lastInActivity = lastOutActivity = millis();
+// Reads the CONNACK, which must already be arriving.
+boolean PubSubClient::readConnack()
+{
+    uint8_t llen;
+    uint16_t len = readPacket(&llen);
 
-            while (!_client->available())
-            {
-                unsigned long t = millis();
+    if (len == 4 && buffer[3] == 0)
+    {
+        lastInActivity = millis();
+        pingOutstanding = false;
+        connectFailures = 0;
+        _state = MQTT_CONNECTED;
+        // Anything sent before we lost the connection may
+        // never have arrived, so send it all again.
+        resend(true);
+        return true;
+    }
 
-                if (t - lastInActivity >= ((int32_t) MQTT_SOCKET_TIMEOUT * 1000UL))
-                {
-                    _state = MQTT_CONNECTION_TIMEOUT;
-                    _client->stop();
-                    return false;
-                }
-            }
+    _state = (len == 4) ? buffer[3] : MQTT_CONNECT_FAILED;
+    _client->stop();
+    return false;
+}
 
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
+// Chooses how long to wait before the next connectAsync() attempt: double the
+// last delay, with jitter so that a fleet of devices doesn't retry in step.
+void PubSubClient::backoff()
+{
+    unsigned long wait = MQTT_BACKOFF_MIN;
 
-            if (len == 4)
-            {
-                if (buffer[3] == 0)
-                {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                }
-                else
-                {
-                    _state = buffer[3];
-                }
-            }
+    for (uint8_t i = 0; i < connectFailures && wait < MQTT_BACKOFF_MAX; i++)
+    {
+        wait *= 2;
+    }
 
-            _client->stop();
-        }
-        else
-        {
-            _state = MQTT_CONNECT_FAILED;
-        }
+    if (wait > MQTT_BACKOFF_MAX)
+    {
+        wait = MQTT_BACKOFF_MAX;
+    }
 
-        return false;
+    if (connectFailures < 255)
+    {
+        connectFailures++;
     }
 
-    return true;
+    connectAttempt = millis();
+    connectWait = random(wait / 2, wait + 1);
 }
 
-// reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result)
+// Reads exactly n bytes into buf, waiting for them until MQTT_SOCKET_TIMEOUT
+// after start.  They're read as many at a time as the client has.
+boolean PubSubClient::readBytes(uint8_t* buf, uint16_t n, unsigned long start)
 {
-    uint32_t previousMillis = millis();
-
-    while (!_client->available())
+    while (n > 0)
     {
-        uint32_t currentMillis = millis();
+        int avail = _client->available();
 
-        if (currentMillis - previousMillis >= ((int32_t) MQTT_SOCKET_TIMEOUT * 1000))
+        if (avail > 0)
         {
-            return false;
-        }
-    }
+            int rc = _client->read(buf, (avail < n) ? avail : n);
 
-    *result = _client->read();
-    return true;
-}
+            if (rc > 0)
+            {
+                buf += rc;
+                n -= rc;
+                continue;
+            }
+        }
 
-// reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index)
-{
-    uint16_t current_index = *index;
-    uint8_t * write_address = &(result[current_index]);
+        if (millis() - start >= MQTT_SOCKET_TIMEOUT * 1000UL)
+        {
+            return false;
+        }
 
-    if (readByte(write_address))
-    {
-        *index = current_index + 1;
-        return true;
+        yield();
     }
 
-    return false;
+    return true;
 }
 
 uint16_t PubSubClient::readPacket(uint8_t* lengthLength)
 {
+    // One deadline for the whole packet.
+    unsigned long start = millis();
     uint16_t len = 0;
 
-    if (!readByte(buffer, &len)) return 0;
+    if (!readBytes(buffer, 1, start)) return 0;
+
+    len++;
 
     bool isPublish = (buffer[0] & 0xF0) == MQTTPUBLISH;
     uint32_t multiplier = 1;
-    uint16_t length = 0;
+    uint32_t length = 0;
     uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint8_t start = 0;
 
     do
     {
-        if (!readByte(&digit)) return 0;
+        // The remaining length takes at most four bytes
+        if (len > 4) return 0;
+
+        if (!readBytes(&digit, 1, start)) return 0;
 
         buffer[len++] = digit;
         length += (digit & 127) * multiplier;
@@ -314,15 +446,17 @@ uint16_t PubSubClient::readPacket(uint8_t* lengthLength)
 
     *lengthLength = len - 1;
 
-    if (isPublish)
-    {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        if (!readByte(buffer, &len)) return 0;
+    // The offset of the payload within the remaining bytes, for Stream writing
+    uint32_t skip = length;
+    uint32_t pos = 0;
 
-        if (!readByte(buffer, &len)) return 0;
+    if (isPublish && length >= 2)
+    {
+        if (!readBytes(buffer + len, 2, start)) return 0;
 
-        skip = (buffer[*lengthLength + 1] << 8) + buffer[*lengthLength + 2];
-        start = 2;
+        skip = 2 + (buffer[len] << 8) + buffer[len + 1];
+        len += 2;
+        pos = 2;
 
         if (buffer[0]&MQTTQOS1)
         {
@@ -331,32 +465,45 @@ uint16_t PubSubClient::readPacket(uint8_t* lengthLength)
         }
     }
 
-    for (uint16_t i = start; i < length; i++)
+    // Read the rest as it arrives, into the buffer while there is room, and
+    // then into scratch, which only the Stream sees.
+    uint8_t scratch[32];
+    uint32_t total = len;
+
+    while (pos < length)
     {
-        if (!readByte(&digit)) return 0;
+        uint8_t* dest = scratch;
+        uint32_t n = sizeof(scratch);
 
-        if (this->stream)
+        if (total < this->bufferSize)
         {
-            if (isPublish && len - *lengthLength - 2 > skip)
-            {
-                this->stream->write(digit);
-            }
+            dest = buffer + total;
+            n = this->bufferSize - total;
+        }
+
+        if (n > length - pos)
+        {
+            n = length - pos;
         }
 
-        if (len < MQTT_MAX_PACKET_SIZE)
+        if (!readBytes(dest, n, start)) return 0;
+
+        if (this->stream && isPublish && pos + n > skip)
         {
-            buffer[len] = digit;
+            uint32_t from = (pos > skip) ? pos : skip;
+            this->stream->write(dest + (from - pos), pos + n - from);
         }
 
-        len++;
+        pos += n;
+        total += n;
     }
 
-    if (!this->stream && len > MQTT_MAX_PACKET_SIZE)
+    if (!this->stream && total > this->bufferSize)
     {
-        len = 0; // This will cause the packet to be ignored.
+        total = 0; // This will cause the packet to be ignored.
     }
 
-    return len;
+    return total;
 }
 
 boolean PubSubClient::loop()
@@ -398,7 +545,7 @@ boolean PubSubClient::loop()
 
                 if (type == MQTTPUBLISH)
                 {
-                    if (callback)
+                    if (callback || topics)
                     {
                         uint16_t tl = (buffer[llen + 1] << 8) + buffer[llen + 2];
                         char topic[tl + 1];
@@ -415,7 +562,7 @@ boolean PubSubClient::loop()
                         {
                             msgId = (buffer[llen + 3 + tl] << 8) + buffer[llen + 3 + tl + 1];
                             payload = buffer + llen + 3 + tl + 2;
-                            callback(topic, payload, len - llen - 3 - tl - 2);
+                            deliver(topic, payload, len - llen - 3 - tl - 2);
 
                             buffer[0] = MQTTPUBACK;
                             buffer[1] = 2;
@@ -428,7 +575,20 @@ boolean PubSubClient::loop()
                         else
                         {
                             payload = buffer + llen + 3 + tl;
-                            callback(topic, payload, len - llen - 3 - tl);
+                            deliver(topic, payload, len - llen - 3 - tl);
+                        }
+                    }
+                }
+                else if (type == MQTTPUBACK && len == 4)
+                {
+                    msgId = (buffer[2] << 8) + buffer[3];
+
+                    for (uint8_t i = 0; inflightMsgs && i < MQTT_MAX_INFLIGHT; i++)
+                    {
+                        if (inflightMsgs[i].msgId == msgId)
+                        {
+                            inflightMsgs[i].msgId = 0;
+                            break;
                         }
                     }
                 }
@@ -445,6 +605,7 @@ boolean PubSubClient::loop()
             }
         }
 
+        resend(false);
         return true;
     }
 
@@ -468,32 +629,103 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained)
 {
+    return publish(topic, payload, plength, retained, 0);
+}
+
+boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained, uint8_t qos)
+{
+    return publish(topic, (const uint8_t*)payload, strlen(payload), retained, qos);
+}
+
+// A QoS 1 message is built in a free slot of the in-flight window, where
+// it stays until the broker acknowledges it, and returns true once it has
+// a slot even if the write fails - loop() will send it again.  If the
+// window is full we return false, and the caller should try later.
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, uint8_t qos)
+{
+    if (qos > 1)
+    {
+        return false;
+    }
+
     if (connected())
     {
-        if (MQTT_MAX_PACKET_SIZE < 5 + 2 + strlen(topic) + plength)
+        if (qos == 1 && !allocateInflight())
         {
-            // Too long
             return false;
         }
 
+        if (qos == 1 && this->inflightSize < 5 + 2 + strlen(topic) + 2 + plength)
+        {
+            // Too long to keep for resending
+            return false;
+        }
+
+        if (qos == 0 && this->bufferSize < 5 + 2 + strlen(topic) + plength)
+        {
+            // Too long for the buffer, so send it as it is
+            return beginPublish(topic, plength, retained) &&
+                   write(payload, plength) == plength &&
+                   endPublish() == 1;
+        }
+
+        MQTTInflight* msg = NULL;
+        uint8_t* buf = buffer;
+
+        if (qos == 1)
+        {
+            for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+            {
+                if (inflightMsgs[i].msgId == 0)
+                {
+                    msg = &inflightMsgs[i];
+                    break;
+                }
+            }
+
+            if (msg == NULL)
+            {
+                // Window full
+                return false;
+            }
+
+            buf = msg->packet;
+        }
+
         // Leave room in the buffer for header and variable length field
         uint16_t length = 5;
-        length = writeString(topic, buffer, length);
+        length = writeString(topic, buf, length);
         uint16_t i;
 
+        if (msg != NULL)
+        {
+            msg->msgId = allocateMsgId();
+            buf[length++] = (msg->msgId >> 8);
+            buf[length++] = (msg->msgId & 0xFF);
+        }
+
         for (i = 0; i < plength; i++)
         {
-            buffer[length++] = payload[i];
+            buf[length++] = payload[i];
         }
 
-        uint8_t header = MQTTPUBLISH;
+        uint8_t header = MQTTPUBLISH | (qos << 1);
 
         if (retained)
         {
             header |= 1;
         }
 
-        return write(header, buffer, length - 5);
+        if (msg != NULL)
+        {
+            msg->header = header;
+            msg->length = length - 5;
+            msg->sent = millis();
+            write(header, buf, length - 5);
+            return true;
+        }
+
+        return write(header, buf, length - 5);
     }
 
     return false;
@@ -556,40 +788,114 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
     return rc == tlen + 4 + plength;
 }
 
-boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length)
+boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained)
 {
-    uint8_t lenBuf[4];
-    uint8_t llen = 0;
-    uint8_t digit;
-    uint8_t pos = 0;
-    uint16_t rc;
-    uint16_t len = length;
-
-    do
+    if (connected())
     {
-        digit = len % 128;
-        len = len / 128;
+        if (this->bufferSize < 5 + 2 + strlen(topic))
+        {
+            // Too long
+            return false;
+        }
 
-        if (len > 0)
+        // Send the fixed header and the topic, leaving the payload to write()
+        uint16_t length = 5;
+        length = writeString(topic, buffer, length);
+
+        uint8_t header = MQTTPUBLISH;
+
+        if (retained)
         {
-            digit |= 0x80;
+            header |= 1;
         }
 
-        lenBuf[pos++] = digit;
-        llen++;
+        uint8_t llen = buildHeader(header, buffer, length - 5 + plength);
+        uint16_t rc = _client->write(buffer + (4 - llen), length - (4 - llen));
+        lastOutActivity = millis();
+        publishRemaining = plength;
+        return (rc == length - (4 - llen));
     }
-    while (len > 0);
 
-    buf[4 - llen] = header;
+    return false;
+}
 
-    for (int i = 0; i < llen; i++)
+int PubSubClient::endPublish()
+{
+    if (publishRemaining == 0)
     {
-        buf[5 - llen + i] = lenBuf[i];
+        return 1;
     }
 
-#ifdef MQTT_MAX_TRANSFER_SIZE
-    uint8_t* writeBuf = buf + (4 - llen);
-    uint16_t bytesRemaining = length + 1 + llen; //Match the length type
+    // The broker is still waiting for the rest of the payload, and would take
+    // whatever we send next as part of it.
+    publishRemaining = 0;
+    _state = MQTT_CONNECTION_LOST;
+    _client->stop();
+    return 0;
+}
+
+size_t PubSubClient::write(uint8_t data)
+{
+    return write(&data, 1);
+}
+
+size_t PubSubClient::write(const uint8_t *buffer, size_t size)
+{
+    if (size > publishRemaining)
+    {
+        size = publishRemaining;
+    }
+
+    size_t rc = _client->write(buffer, size);
+    publishRemaining -= rc;
+    lastOutActivity = millis();
+    return rc;
+}
+
+// Writes the fixed header, and the remaining length, into the five bytes at
+// the start of buf so that they end at buf[4], and returns the number of
+// bytes used by the length.
+uint8_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint32_t length)
+{
+    uint8_t lenBuf[4];
+    uint8_t llen = 0;
+    uint8_t digit;
+    uint8_t pos = 0;
+    uint32_t len = length;
+
+    do
+    {
+        digit = len % 128;
+        len = len / 128;
+
+        if (len > 0)
+        {
+            digit |= 0x80;
+        }
+
+        lenBuf[pos++] = digit;
+        llen++;
+    }
+    while (len > 0 && llen < 4);
+
+    buf[4 - llen] = header;
+
+    for (int i = 0; i < llen; i++)
+    {
+        buf[5 - llen + i] = lenBuf[i];
+    }
+
+    return llen;
+}
+
+boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length)
+{
+    uint16_t rc;
+    uint8_t llen = buildHeader(header, buf, length);
+
+#ifdef MQTT_MAX_TRANSFER_SIZE
+    uint8_t* writeBuf = buf + (4 - llen);
+    uint16_t bytesRemaining = length + 1 + llen; //Match the length type
     uint8_t bytesToWrite;
     boolean result = true;
 
@@ -622,7 +928,7 @@ boolean PubSubClient::subscribe(const char* topic, uint8_t qos)
         return false;
     }
 
-    if (MQTT_MAX_PACKET_SIZE < 9 + strlen(topic))
+    if (this->bufferSize < 9 + strlen(topic))
     {
         // Too long
         return false;
@@ -632,13 +938,7 @@ boolean PubSubClient::subscribe(const char* topic, uint8_t qos)
     {
         // Leave room in the buffer for header and variable length field
         uint16_t length = 5;
-        nextMsgId++;
-
-        if (nextMsgId == 0)
-        {
-            nextMsgId = 1;
-        }
-
+        allocateMsgId();
         buffer[length++] = (nextMsgId >> 8);
         buffer[length++] = (nextMsgId & 0xFF);
         length = writeString((char*)topic, buffer, length);
@@ -649,9 +949,36 @@ boolean PubSubClient::subscribe(const char* topic, uint8_t qos)
     return false;
 }
 
+boolean PubSubClient::subscribe(const char* topic, uint8_t qos, MQTTHandler handler)
+{
+    if (qos > 1)
+    {
+        return false;
+    }
+
+    if (this->topics == NULL)
+    {
+        this->topics = new MQTTTopicTrie();
+    }
+
+    // The handler is kept even if we can't subscribe now, as it will be
+    // wanted once the sketch subscribes again after reconnecting.
+    if (!this->topics->add(topic, handler))
+    {
+        return false;
+    }
+
+    return subscribe(topic, qos);
+}
+
 boolean PubSubClient::unsubscribe(const char* topic)
 {
-    if (MQTT_MAX_PACKET_SIZE < 9 + strlen(topic))
+    if (this->topics)
+    {
+        this->topics->remove(topic);
+    }
+
+    if (this->bufferSize < 9 + strlen(topic))
     {
         // Too long
         return false;
@@ -660,6 +987,38 @@ boolean PubSubClient::unsubscribe(const char* topic)
     if (connected())
     {
         uint16_t length = 5;
+        allocateMsgId();
+        buffer[length++] = (nextMsgId >> 8);
+        buffer[length++] = (nextMsgId & 0xFF);
+        length = writeString(topic, buffer, length);
+        return write(MQTTUNSUBSCRIBE | MQTTQOS1, buffer, length - 5);
+    }
+
+    return false;
+}
+
+// Pass a message to the handlers of the filters it matches, or failing that
+// to the callback.
+void PubSubClient::deliver(char* topic, uint8_t* payload, unsigned int length)
+{
+    if (this->topics && this->topics->dispatch(topic, payload, length) > 0)
+    {
+        return;
+    }
+
+    if (callback)
+    {
+        callback(topic, payload, length);
+    }
+}
+
+// Message ids are never 0, and we mustn't reuse one still awaiting a PUBACK.
+uint16_t PubSubClient::allocateMsgId()
+{
+    boolean used;
+
+    do
+    {
         nextMsgId++;
 
         if (nextMsgId == 0)
@@ -667,13 +1026,37 @@ boolean PubSubClient::unsubscribe(const char* topic)
             nextMsgId = 1;
         }
 
-        buffer[length++] = (nextMsgId >> 8);
-        buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString(topic, buffer, length);
-        return write(MQTTUNSUBSCRIBE | MQTTQOS1, buffer, length - 5);
+        used = false;
+
+        for (uint8_t i = 0; inflightMsgs && i < MQTT_MAX_INFLIGHT; i++)
+        {
+            if (inflightMsgs[i].msgId == nextMsgId)
+            {
+                used = true;
+            }
+        }
     }
+    while (used);
 
-    return false;
+    return nextMsgId;
+}
+
+// Send unacknowledged QoS 1 messages again, with the DUP flag set - all of
+// them, or just those which have waited longer than MQTT_RETRY_INTERVAL.
+void PubSubClient::resend(boolean all)
+{
+    unsigned long t = millis();
+
+    for (uint8_t i = 0; inflightMsgs && i < MQTT_MAX_INFLIGHT; i++)
+    {
+        MQTTInflight* msg = &inflightMsgs[i];
+
+        if (msg->msgId != 0 && (all || t - msg->sent >= MQTT_RETRY_INTERVAL))
+        {
+            write(msg->header | MQTTDUP, msg->packet, msg->length);
+            msg->sent = t;
+        }
+    }
 }
 
 void PubSubClient::disconnect()
@@ -684,6 +1067,8 @@ void PubSubClient::disconnect()
     _state = MQTT_DISCONNECTED;
     _client->stop();
     lastInActivity = lastOutActivity = millis();
+    // A deliberate disconnect may reconnect at once.
+    connectFailures = 0;
 }
 
 uint16_t PubSubClient::writeString(const char* string, uint8_t* buf, uint16_t pos)
@@ -714,7 +1099,8 @@ boolean PubSubClient::connected()
     }
     else
     {
-        rc = (int)_client->connected();
+        // Not until we have the CONNACK.
+        rc = (int)_client->connected() && this->_state != MQTT_CONNECTING;
 
         if (!rc)
         {
@@ -769,7 +1155,459 @@ PubSubClient& PubSubClient::setStream(Stream& stream)
     return *this;
 }
 
+boolean PubSubClient::setBufferSize(uint16_t size)
+{
+    if (size == 0)
+    {
+        return false;
+    }
+
+    uint8_t* newBuffer = (uint8_t*)realloc(this->buffer, size);
+
+    if (newBuffer == NULL)
+    {
+        return false;
+    }
+
+    this->buffer = newBuffer;
+    this->bufferSize = size;
+
+    // An empty window is resized along with the buffer, the next time it's
+    // needed.  One still in use keeps its size until then.
+    if (this->inflightMsgs && this->inflightSize != size && inflight() == 0)
+    {
+        freeInflight();
+    }
+
+    return true;
+}
+
+// Allocate the QoS 1 window, with a slot for each message as large as the
+// buffer, the first time it's needed.
+boolean PubSubClient::allocateInflight()
+{
+    if (this->inflightMsgs)
+    {
+        return true;
+    }
+
+    MQTTInflight* msgs = (MQTTInflight*)malloc(MQTT_MAX_INFLIGHT * sizeof(MQTTInflight));
+    uint8_t* packets = (uint8_t*)malloc(MQTT_MAX_INFLIGHT * this->bufferSize);
+
+    if (msgs == NULL || packets == NULL)
+    {
+        free(msgs);
+        free(packets);
+        return false;
+    }
+
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+    {
+        msgs[i].msgId = 0;
+        msgs[i].packet = packets + i * this->bufferSize;
+    }
+
+    this->inflightMsgs = msgs;
+    this->inflightSize = this->bufferSize;
+    return true;
+}
+
+void PubSubClient::freeInflight()
+{
+    if (this->inflightMsgs)
+    {
+        free(this->inflightMsgs[0].packet);
+        free(this->inflightMsgs);
+        this->inflightMsgs = NULL;
+        this->inflightSize = 0;
+    }
+}
+
+uint16_t PubSubClient::getBufferSize()
+{
+    return this->bufferSize;
+}
+
 int PubSubClient::state()
 {
     return this->_state;
 }
+
+int PubSubClient::inflight()
+{
+    int count = 0;
+
+    for (uint8_t i = 0; inflightMsgs && i < MQTT_MAX_INFLIGHT; i++)
+    {
+        if (inflightMsgs[i].msgId != 0)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+MQTTTopicTrie::MQTTTopicTrie()
+{
+    for (uint8_t i = 0; i < MQTT_MAX_TOPIC_NODES; i++)
+    {
+        nodes[i].child = MQTT_NO_NODE;
+        nodes[i].sibling = MQTT_NO_NODE;
+        nodes[i].handler = MQTT_NO_HANDLER;
+        nodes[i].length = 0;
+        nodes[i].name = 0;
+        nodes[i].used = false;
+    }
+
+    for (uint8_t i = 0; i < MQTT_MAX_HANDLERS; i++)
+    {
+        handlers[i] = MQTTHandler();
+    }
+
+    // The root
+    nodes[0].used = true;
+    namesUsed = 0;
+}
+
+// A filter is valid if "+" and "#" only appear as whole levels, and "#" only
+// as the last.
+boolean MQTTTopicTrie::valid(const char* filter)
+{
+    const char* level = filter;
+    uint8_t depth = 0;
+
+    if (filter[0] == 0)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        const char* end = strchr(level, '/');
+        size_t length = end ? (size_t)(end - level) : strlen(level);
+
+        if (length > 255 || ++depth >= MQTT_MAX_TOPIC_NODES)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < length; i++)
+        {
+            if ((level[i] == '+' || level[i] == '#') && length != 1)
+            {
+                return false;
+            }
+        }
+
+        if (length == 1 && level[0] == '#' && end)
+        {
+            return false;
+        }
+
+        if (!end)
+        {
+            return true;
+        }
+
+        level = end + 1;
+    }
+}
+
+// Find the nodes for each level of the filter, creating them if asked to.
+// path[0] is the root, and we return how many levels were found, which is
+// less than there are in the filter if we stopped short.
+uint8_t MQTTTopicTrie::walk(const char* filter, uint8_t* path, boolean create)
+{
+    const char* level = filter;
+    uint8_t depth = 0;
+
+    path[0] = 0;
+
+    while (true)
+    {
+        const char* end = strchr(level, '/');
+        uint8_t length = end ? end - level : strlen(level);
+        uint8_t child = findChild(path[depth], level, length);
+
+        if (child == MQTT_NO_NODE && create)
+        {
+            child = addChild(path[depth], level, length);
+        }
+
+        if (child == MQTT_NO_NODE)
+        {
+            return depth;
+        }
+
+        path[++depth] = child;
+
+        if (!end)
+        {
+            return depth;
+        }
+
+        level = end + 1;
+    }
+}
+
+// Free the nodes at the end of the path which no longer lead to a handler.
+void MQTTTopicTrie::prune(uint8_t* path, uint8_t depth)
+{
+    for (; depth > 0; depth--)
+    {
+        uint8_t node = path[depth];
+        uint8_t parent = path[depth - 1];
+
+        if (nodes[node].child != MQTT_NO_NODE || nodes[node].handler != MQTT_NO_HANDLER)
+        {
+            return;
+        }
+
+        if (nodes[parent].child == node)
+        {
+            nodes[parent].child = nodes[node].sibling;
+        }
+        else
+        {
+            uint8_t prev = nodes[parent].child;
+
+            while (nodes[prev].sibling != node)
+            {
+                prev = nodes[prev].sibling;
+            }
+
+            nodes[prev].sibling = nodes[node].sibling;
+        }
+
+        nodes[node].used = false;
+        nodes[node].child = MQTT_NO_NODE;
+        nodes[node].sibling = MQTT_NO_NODE;
+    }
+}
+
+uint8_t MQTTTopicTrie::levels(const char* filter)
+{
+    uint8_t count = 1;
+
+    for (; *filter; filter++)
+    {
+        if (*filter == '/')
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+boolean MQTTTopicTrie::add(const char* filter, MQTTHandler handler)
+{
+    uint8_t path[MQTT_MAX_TOPIC_NODES];
+
+    if (!handler || !valid(filter))
+    {
+        return false;
+    }
+
+    uint8_t depth = walk(filter, path, true);
+
+    if (depth == levels(filter))
+    {
+        Node& node = nodes[path[depth]];
+
+        if (node.handler != MQTT_NO_HANDLER)
+        {
+            handlers[node.handler] = handler;
+            return true;
+        }
+
+        for (uint8_t i = 0; i < MQTT_MAX_HANDLERS; i++)
+        {
+            if (!handlers[i])
+            {
+                handlers[i] = handler;
+                node.handler = i;
+                return true;
+            }
+        }
+    }
+
+    // Out of room, so undo whatever we added.
+    prune(path, depth);
+    return false;
+}
+
+boolean MQTTTopicTrie::remove(const char* filter)
+{
+    uint8_t path[MQTT_MAX_TOPIC_NODES];
+
+    if (!valid(filter))
+    {
+        return false;
+    }
+
+    uint8_t depth = walk(filter, path, false);
+    Node& node = nodes[path[depth]];
+
+    if (depth != levels(filter) || node.handler == MQTT_NO_HANDLER)
+    {
+        return false;
+    }
+
+    handlers[node.handler] = MQTTHandler();
+    node.handler = MQTT_NO_HANDLER;
+    prune(path, depth);
+    return true;
+}
+
+uint8_t MQTTTopicTrie::findChild(uint8_t parent, const char* name, uint8_t length)
+{
+    for (uint8_t c = nodes[parent].child; c != MQTT_NO_NODE; c = nodes[c].sibling)
+    {
+        if (nodes[c].length == length && memcmp(names + nodes[c].name, name, length) == 0)
+        {
+            return c;
+        }
+    }
+
+    return MQTT_NO_NODE;
+}
+
+uint8_t MQTTTopicTrie::addChild(uint8_t parent, const char* name, uint8_t length)
+{
+    uint8_t c;
+
+    for (c = 1; c < MQTT_MAX_TOPIC_NODES; c++)
+    {
+        if (!nodes[c].used)
+        {
+            break;
+        }
+    }
+
+    if (c == MQTT_MAX_TOPIC_NODES)
+    {
+        return MQTT_NO_NODE;
+    }
+
+    if (namesUsed + length > MQTT_TOPIC_NAMES)
+    {
+        compactNames();
+
+        if (namesUsed + length > MQTT_TOPIC_NAMES)
+        {
+            return MQTT_NO_NODE;
+        }
+    }
+
+    memcpy(names + namesUsed, name, length);
+    nodes[c].name = namesUsed;
+    nodes[c].length = length;
+    nodes[c].handler = MQTT_NO_HANDLER;
+    nodes[c].child = MQTT_NO_NODE;
+    nodes[c].sibling = nodes[parent].child;
+    nodes[c].used = true;
+    nodes[parent].child = c;
+    namesUsed += length;
+    return c;
+}
+
+// The names of freed nodes aren't reclaimed until we run out of room, when
+// those still used are moved down, in order, over the gaps.
+void MQTTTopicTrie::compactNames()
+{
+    uint16_t used = 0;
+    int32_t last = -1;
+
+    while (true)
+    {
+        uint8_t next = MQTT_NO_NODE;
+
+        for (uint8_t i = 1; i < MQTT_MAX_TOPIC_NODES; i++)
+        {
+            if (nodes[i].used && nodes[i].length > 0 && (int32_t)nodes[i].name > last &&
+                    (next == MQTT_NO_NODE || nodes[i].name < nodes[next].name))
+            {
+                next = i;
+            }
+        }
+
+        if (next == MQTT_NO_NODE)
+        {
+            break;
+        }
+
+        last = nodes[next].name;
+        memmove(names + used, names + nodes[next].name, nodes[next].length);
+        nodes[next].name = used;
+        used += nodes[next].length;
+    }
+
+    namesUsed = used;
+}
+
+int MQTTTopicTrie::call(uint8_t node, char* topic, uint8_t* payload, unsigned int length)
+{
+    if (nodes[node].handler == MQTT_NO_HANDLER)
+    {
+        return 0;
+    }
+
+    handlers[nodes[node].handler](topic, payload, length);
+    return 1;
+}
+
+// Call the handlers of the filters below parent which match the topic from
+// level onwards, returning how many there were.
+int MQTTTopicTrie::match(uint8_t parent, const char* level, char* topic, uint8_t* payload, unsigned int length)
+{
+    const char* end = strchr(level, '/');
+    size_t len = end ? (size_t)(end - level) : strlen(level);
+    int matched = 0;
+
+    // Filters starting with a wildcard don't match topics starting with "$".
+    boolean wild = !(parent == 0 && level[0] == '$');
+
+    for (uint8_t c = nodes[parent].child; c != MQTT_NO_NODE; c = nodes[c].sibling)
+    {
+        const char* name = names + nodes[c].name;
+        boolean single = (nodes[c].length == 1);
+
+        if (single && name[0] == '#')
+        {
+            if (wild)
+            {
+                matched += call(c, topic, payload, length);
+            }
+        }
+        else if ((single && name[0] == '+' && wild) ||
+                 (nodes[c].length == len && memcmp(name, level, len) == 0))
+        {
+            if (end)
+            {
+                matched += match(c, end + 1, topic, payload, length);
+                continue;
+            }
+
+            matched += call(c, topic, payload, length);
+
+            // "a/#" matches "a" too
+            for (uint8_t g = nodes[c].child; g != MQTT_NO_NODE; g = nodes[g].sibling)
+            {
+                if (nodes[g].length == 1 && names[nodes[g].name] == '#')
+                {
+                    matched += call(g, topic, payload, length);
+                }
+            }
+        }
+    }
+
+    return matched;
+}
+
+int MQTTTopicTrie::dispatch(char* topic, uint8_t* payload, unsigned int length)
+{
+    return match(0, topic, topic, payload, length);
+}
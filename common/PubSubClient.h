@@ -11,6 +11,7 @@
 #include "IPAddress.h"
 #include "Client.h"
 #include "Stream.h"
+#include "Print.h"
 
 #define MQTT_VERSION_3_1      3
 #define MQTT_VERSION_3_1_1    4
@@ -21,7 +22,9 @@
 #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
 
-// MQTT_MAX_PACKET_SIZE : Maximum packet size
+// MQTT_MAX_PACKET_SIZE : Maximum packet size.  This is the default size of the
+//  buffer, which can be changed with setBufferSize(), and so of the largest
+//  QoS 1 message, as each of those is kept until it is acknowledged.
 #ifndef MQTT_MAX_PACKET_SIZE
 #define MQTT_MAX_PACKET_SIZE 128
 #endif
@@ -36,12 +39,56 @@
 #define MQTT_SOCKET_TIMEOUT 15
 #endif
 
+// MQTT_BACKOFF_MIN : the delay after a failed connectAsync() attempt, in
+//  milliseconds.  It doubles with each failure, up to MQTT_BACKOFF_MAX, and
+//  the actual delay is chosen at random from half to all of it.
+#ifndef MQTT_BACKOFF_MIN
+#define MQTT_BACKOFF_MIN 1000
+#endif
+
+#ifndef MQTT_BACKOFF_MAX
+#define MQTT_BACKOFF_MAX 60000
+#endif
+
+// MQTT_MAX_INFLIGHT : Maximum number of QoS 1 messages awaiting a PUBACK.
+//  Once the window is full publish() returns false until one is acknowledged.
+//  The window is only allocated by the first QoS 1 publish, with a slot the
+//  size of the buffer for each message.
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+
+// MQTT_RETRY_INTERVAL : how long to wait for a PUBACK, in milliseconds, before
+//  sending a QoS 1 message again with the DUP flag set.
+#ifndef MQTT_RETRY_INTERVAL
+#define MQTT_RETRY_INTERVAL 5000
+#endif
+
+// MQTT_MAX_HANDLERS : the number of topic filters which may have a handler of
+//  their own, given to subscribe().  Messages matching none of them go to the
+//  callback.
+#ifndef MQTT_MAX_HANDLERS
+#define MQTT_MAX_HANDLERS 8
+#endif
+
+// MQTT_MAX_TOPIC_NODES : the number of distinct levels across those filters,
+//  and MQTT_TOPIC_NAMES the bytes available to hold their names.  Filters
+//  sharing a prefix share its levels.
+#ifndef MQTT_MAX_TOPIC_NODES
+#define MQTT_MAX_TOPIC_NODES 32
+#endif
+
+#ifndef MQTT_TOPIC_NAMES
+#define MQTT_TOPIC_NAMES 256
+#endif
+
 // MQTT_MAX_TRANSFER_SIZE : limit how much data is passed to the network client
 //  in each write call. Needed for the Arduino Wifi Shield. Leave undefined to
 //  pass the entire MQTT packet in each write call.
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
 // Possible values for client.state()
+#define MQTT_CONNECTING             -5
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -73,28 +120,99 @@
 #define MQTTQOS1        (1 << 1)
 #define MQTTQOS2        (2 << 1)
 
+#define MQTTDUP         (1 << 3)
+
 #ifdef ESP8266
 #include <functional>
 #define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+typedef std::function<void(char*, uint8_t*, unsigned int)> MQTTHandler;
 #else
 #define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+typedef void (*MQTTHandler)(char*, uint8_t*, unsigned int);
 #endif
 
-class PubSubClient
+#define MQTT_NO_NODE    0xFF
+#define MQTT_NO_HANDLER 0xFF
+
+// A QoS 1 message we've sent, kept until the broker acknowledges it.  The
+// packet is laid out as in buffer, with room for the fixed header, so that
+// it can be passed straight to write() again.
+struct MQTTInflight
+{
+    uint16_t msgId;     // 0 if the slot is free
+    uint8_t header;
+    uint16_t length;
+    unsigned long sent;
+    uint8_t* packet;    // inflightSize bytes
+};
+
+// The topic filters with handlers of their own, as a trie of their levels.
+// Node 0 is the root, and the children of each node are a list linked
+// through sibling, so a topic is matched by walking down one level at a
+// time, following the children named for that level, "+", and "#".
+class MQTTTopicTrie
+{
+private:
+    struct Node
+    {
+        uint8_t child;    // first child, or MQTT_NO_NODE
+        uint8_t sibling;  // next child of our parent, or MQTT_NO_NODE
+        uint8_t handler;  // index into handlers, or MQTT_NO_HANDLER
+        uint8_t length;   // of our name
+        uint16_t name;    // offset of our name in names
+        boolean used;
+    };
+    Node nodes[MQTT_MAX_TOPIC_NODES];
+    char names[MQTT_TOPIC_NAMES];
+    uint16_t namesUsed;
+    MQTTHandler handlers[MQTT_MAX_HANDLERS];
+    uint8_t findChild(uint8_t parent, const char* name, uint8_t length);
+    uint8_t addChild(uint8_t parent, const char* name, uint8_t length);
+    uint8_t walk(const char* filter, uint8_t* path, boolean create);
+    void prune(uint8_t* path, uint8_t depth);
+    static uint8_t levels(const char* filter);
+    void compactNames();
+    int call(uint8_t node, char* topic, uint8_t* payload, unsigned int length);
+    int match(uint8_t parent, const char* level, char* topic, uint8_t* payload, unsigned int length);
+public:
+    MQTTTopicTrie();
+    static boolean valid(const char* filter);
+    boolean add(const char* filter, MQTTHandler handler);
+    boolean remove(const char* filter);
+    int dispatch(char* topic, uint8_t* payload, unsigned int length);
+};
+
+class PubSubClient : public Print
 {
 private:
     Client* _client;
-    uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+    uint8_t* buffer = NULL;
+    uint16_t bufferSize = 0;
+    unsigned int publishRemaining = 0;
     uint16_t nextMsgId;
     unsigned long lastOutActivity;
     unsigned long lastInActivity;
     bool pingOutstanding;
     MQTT_CALLBACK_SIGNATURE;
+    MQTTTopicTrie* topics = NULL;
     uint16_t readPacket(uint8_t*);
-    boolean readByte(uint8_t * result);
-    boolean readByte(uint8_t * result, uint16_t * index);
+    void deliver(char* topic, uint8_t* payload, unsigned int length);
+    boolean readBytes(uint8_t* buf, uint16_t n, unsigned long start);
     boolean write(uint8_t header, uint8_t* buf, uint16_t length);
+    uint8_t buildHeader(uint8_t header, uint8_t* buf, uint32_t length);
     uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
+    uint16_t allocateMsgId();
+    boolean sendConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+    boolean readConnack();
+    void backoff();
+    uint8_t connectFailures = 0;
+    unsigned long connectAttempt = 0;
+    unsigned long connectWait = 0;
+    void resend(boolean all);
+    boolean allocateInflight();
+    void freeInflight();
+    MQTTInflight* inflightMsgs = NULL;
+    uint16_t inflightSize = 0;
     IPAddress ip;
     const char* domain;
     uint16_t port;
@@ -115,6 +233,7 @@ public:
     PubSubClient(const char*, uint16_t, Client& client, Stream&);
     PubSubClient(const char*, uint16_t, MQTT_CALLBACK_SIGNATURE, Client& client);
     PubSubClient(const char*, uint16_t, MQTT_CALLBACK_SIGNATURE, Client& client, Stream&);
+    ~PubSubClient();
 
     PubSubClient& setServer(IPAddress ip, uint16_t port);
     PubSubClient& setServer(uint8_t * ip, uint16_t port);
@@ -123,22 +242,42 @@ public:
     PubSubClient& setClient(Client& client);
     PubSubClient& setStream(Stream& stream);
 
+    boolean setBufferSize(uint16_t size);
+    uint16_t getBufferSize();
+
     boolean connect(const char* id);
     boolean connect(const char* id, const char* user, const char* pass);
     boolean connect(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
     boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+    boolean connectAsync(const char* id);
+    boolean connectAsync(const char* id, const char* user, const char* pass);
+    boolean connectAsync(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
     void disconnect();
     boolean publish(const char* topic, const char* payload);
     boolean publish(const char* topic, const char* payload, boolean retained);
     boolean publish(const char* topic, const uint8_t * payload, unsigned int plength);
     boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+    boolean publish(const char* topic, const char* payload, boolean retained, uint8_t qos);
+    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, uint8_t qos);
     boolean publish_P(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+
+    // Start to publish a message at QoS 0, whose payload of plength bytes is
+    // then given to write() or print(), and sent as it is written.
+    boolean beginPublish(const char* topic, unsigned int plength, boolean retained);
+    // Finish the message, returning 1 if all of the payload was written.
+    int endPublish();
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buffer, size_t size);
     boolean subscribe(const char* topic);
     boolean subscribe(const char* topic, uint8_t qos);
+    // Subscribe, and pass messages matching the filter to handler rather than
+    // the callback.  Handlers mustn't subscribe or unsubscribe themselves.
+    boolean subscribe(const char* topic, uint8_t qos, MQTTHandler handler);
     boolean unsubscribe(const char* topic);
     boolean loop();
     boolean connected();
     int state();
+    int inflight();
 };
 
 
@@ -0,0 +1,148 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// For the resolver.
+//
+#include <ESP8266WiFi.h>
+
+//
+// Our header.
+//
+#include "dns_cache.h"
+
+
+/*
+ * The cached hosts, and our statistics.
+ */
+DnsCache::Entry DnsCache::s_entries[DNS_CACHE_ENTRIES];
+unsigned long DnsCache::s_ttl = DNS_CACHE_TTL;
+unsigned long DnsCache::s_hits = 0;
+unsigned long DnsCache::s_misses = 0;
+unsigned long DnsCache::s_stale = 0;
+
+
+/*
+ * Find the address of the given host.
+ *
+ * If we don't have it, we replace the entry which was used least
+ * recently.
+ */
+bool DnsCache::resolve(const char *host, IPAddress &ip)
+{
+    unsigned long now = millis();
+
+    //
+    // Names too long for our cache are always looked up.
+    //
+    if (strlen(host) >= sizeof(s_entries[0].host))
+    {
+        s_misses += 1;
+        return (WiFi.hostByName(host, ip) == 1);
+    }
+
+    Entry *entry = NULL;
+
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+    {
+        Entry *e = &s_entries[i];
+
+        if (strcmp(e->host, host) == 0)
+        {
+            entry = e;
+            break;
+        }
+
+        if (entry == NULL || e->host[0] == '\0' ||
+                (entry->host[0] != '\0' && e->last_used < entry->last_used))
+            entry = e;
+    }
+
+    //
+    // Still fresh?  Then there's no need to ask.
+    //
+    bool found = (strcmp(entry->host, host) == 0);
+
+    if (found && now - entry->resolved < s_ttl)
+    {
+        s_hits += 1;
+        entry->last_used = now;
+        ip = entry->ip;
+        return true;
+    }
+
+    s_misses += 1;
+
+    IPAddress resolved;
+
+    if (WiFi.hostByName(host, resolved) == 1)
+    {
+        strcpy(entry->host, host);
+        entry->ip = resolved;
+        entry->resolved = now;
+        entry->last_used = now;
+        ip = resolved;
+        return true;
+    }
+
+    //
+    // The resolver failed, so use what we had, if anything.
+    //
+    if (found)
+    {
+        s_stale += 1;
+        entry->last_used = now;
+        ip = entry->ip;
+        return true;
+    }
+
+    return false;
+}
+
+
+/*
+ * Set how long we'll use an address for.
+ */
+void DnsCache::setTTL(unsigned long ms)
+{
+    s_ttl = ms;
+}
+
+
+/*
+ * Forget everything.
+ */
+void DnsCache::flush()
+{
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+        s_entries[i].host[0] = '\0';
+}
+
+
+/*
+ * The number of lookups served from the cache.
+ */
+unsigned long DnsCache::hits()
+{
+    return s_hits;
+}
+
+
+/*
+ * The number of lookups which used the resolver.
+ */
+unsigned long DnsCache::misses()
+{
+    return s_misses;
+}
+
+
+/*
+ * The number of lookups which returned an expired address.
+ */
+unsigned long DnsCache::stale()
+{
+    return s_stale;
+}
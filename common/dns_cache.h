@@ -0,0 +1,95 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <IPAddress.h>
+
+/*
+ * A small cache of DNS lookups, shared by everything which connects
+ * to a remote host by name - UrlFetcher, PubSubClient, & NTPClient.
+ *
+ * Usage is as simple as:
+ *
+ *   IPAddress ip;
+ *
+ *   if ( DnsCache::resolve( "steve.fi", ip ) )
+ *       client.connect( ip, 80 );
+ *
+ * A lookup is remembered for DNS_CACHE_TTL milliseconds, as the core
+ * doesn't tell us the TTL the server gave.  If a later lookup fails
+ * we return the address we had, however old it is, rather than fail.
+ */
+
+
+/*
+ * The number of hosts we'll remember.
+ */
+#ifndef DNS_CACHE_ENTRIES
+#define DNS_CACHE_ENTRIES 4
+#endif
+
+/*
+ * How long we'll use an address before looking it up again, in
+ * milliseconds.
+ */
+#ifndef DNS_CACHE_TTL
+#define DNS_CACHE_TTL 300000
+#endif
+
+
+class DnsCache
+{
+public:
+
+    /*
+     * Find the address of the given host, using our cache if we can.
+     *
+     * Returns false if the host couldn't be resolved, and we've never
+     * resolved it before.
+     */
+    static bool resolve(const char *host, IPAddress &ip);
+
+    /*
+     * Set how long we'll use an address for, in milliseconds.
+     */
+    static void setTTL(unsigned long ms);
+
+    /*
+     * Forget everything we've cached.
+     */
+    static void flush();
+
+    /*
+     * The number of lookups served from the cache, the number which
+     * needed the resolver, and the number where the resolver failed
+     * and we returned an expired address instead.
+     */
+    static unsigned long hits();
+    static unsigned long misses();
+    static unsigned long stale();
+
+
+private:
+
+    /*
+     * A resolved host.
+     */
+    struct Entry
+    {
+        char host[64];
+        IPAddress ip;
+        unsigned long resolved;
+        unsigned long last_used;
+    };
+
+    /*
+     * Our cache, and how useful it has been.
+     */
+    static Entry s_entries[DNS_CACHE_ENTRIES];
+    static unsigned long s_ttl;
+    static unsigned long s_hits;
+    static unsigned long s_misses;
+    static unsigned long s_stale;
+
+};
+
+#endif /* DNS_CACHE_H */
@@ -0,0 +1,218 @@
+//
+// Benchmark how fast PubSubClient reads messages on the host, against
+// the stand-in broker.
+//
+// We subscribe to a flood of messages of each size, and read them with
+// PubSubClient::loop(), then again with the byte-at-a-time reader it
+// used to have, which waited on available() and called millis() for
+// every byte.
+//
+// Usage:
+//
+//    ./mqtt_bench [-n count] [-p port] size ..
+//
+//    -n  The number of messages of each size, default 2000.
+//    -p  The port of the broker, default 1883.
+//
+// See README.md for how to build it, and the broker to run it against.
+//
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include "PubSubClient.h"
+
+
+//
+// The reader PubSubClient used to have, for comparison.
+//
+static bool old_read_byte(Client &client, uint8_t *result)
+{
+    uint32_t previousMillis = millis();
+
+    while (!client.available())
+    {
+        uint32_t currentMillis = millis();
+
+        if (currentMillis - previousMillis >= ((int32_t) MQTT_SOCKET_TIMEOUT * 1000))
+            return false;
+    }
+
+    *result = client.read();
+    return true;
+}
+
+static uint16_t old_read_packet(Client &client, uint8_t *buffer, uint16_t size)
+{
+    uint16_t len = 0;
+    uint8_t digit = 0;
+    uint32_t multiplier = 1;
+    uint16_t length = 0;
+
+    if (!old_read_byte(client, &buffer[len++]))
+        return 0;
+
+    do
+    {
+        if (!old_read_byte(client, &digit))
+            return 0;
+
+        buffer[len++] = digit;
+        length += (digit & 127) * multiplier;
+        multiplier *= 128;
+    }
+    while ((digit & 128) != 0);
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        if (!old_read_byte(client, &digit))
+            return 0;
+
+        if (len < size)
+            buffer[len] = digit;
+
+        len++;
+    }
+
+    return (len > size) ? 0 : len;
+}
+
+
+//
+// The messages, and bytes, we've received.
+//
+static unsigned long g_messages = 0;
+static unsigned long g_bytes = 0;
+
+static void callback(char *, uint8_t *, unsigned int length)
+{
+    g_messages += 1;
+    g_bytes += length;
+}
+
+
+//
+// Subscribe to count messages of the given size, and read them, with
+// the current reader or the old one.  Returns the time taken in
+// microseconds, or zero on failure.
+//
+static unsigned long run(uint16_t port, int count, int size, bool old)
+{
+    WiFiClient net;
+    PubSubClient client(IPAddress(127, 0, 0, 1), port, callback, net);
+
+    client.setBufferSize(size + 16);
+
+    if (!client.connect("mqtt_bench"))
+        return 0;
+
+    char topic[32];
+    snprintf(topic, sizeof(topic), "bench/%d/%d", count, size);
+
+    g_messages = 0;
+    g_bytes = 0;
+
+    unsigned long started = micros();
+    client.subscribe(topic);
+
+    if (old)
+    {
+        //
+        // The first packet is the SUBACK.
+        //
+        uint8_t *buffer = (uint8_t *)malloc(size + 16);
+
+        for (int i = 0; i <= count; i++)
+        {
+            uint16_t len = old_read_packet(net, buffer, size + 16);
+
+            if (len == 0)
+                break;
+
+            if ((buffer[0] & 0xF0) == MQTTPUBLISH)
+            {
+                uint8_t llen = 1;
+
+                while (buffer[llen] & 128)
+                    llen++;
+
+                uint16_t tl = (buffer[llen + 1] << 8) + buffer[llen + 2];
+                callback(NULL, buffer + llen + 3 + tl, len - llen - 3 - tl);
+            }
+        }
+
+        free(buffer);
+    }
+    else
+    {
+        while (g_messages < (unsigned long)count && client.loop())
+            ;
+    }
+
+    unsigned long elapsed = micros() - started;
+
+    client.disconnect();
+
+    if (g_messages != (unsigned long)count || g_bytes != (unsigned long)count * size)
+    {
+        printf("FAILED: %s received %lu messages, %lu bytes\n",
+               old ? "old" : "new", g_messages, g_bytes);
+        return 0;
+    }
+
+    return elapsed;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int count = 2000;
+    uint16_t port = 1883;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+
+        case 'p':
+            port = atoi(optarg);
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-n count] [-p port] size ..\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%8s %8s %12s %12s %12s %12s\n",
+           "size", "reader", "msgs/s", "KB/s", "reads/msg", "us/msg");
+
+    for (int i = optind; i < argc; i++)
+    {
+        int size = atoi(argv[i]);
+
+        for (int old = 1; old >= 0; old--)
+        {
+            unsigned long reads = WiFiClient::read_calls;
+            unsigned long elapsed = run(port, count, size, old);
+
+            if (elapsed == 0)
+                return 1;
+
+            double secs = elapsed / 1000000.0;
+
+            printf("%8d %8s %12.0f %12.1f %12.1f %12.2f\n",
+                   size, old ? "old" : "new",
+                   count / secs,
+                   (double)count * size / 1024.0 / secs,
+                   (double)(WiFiClient::read_calls - reads) / count,
+                   (double)elapsed / count);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+//
+// Minimal host-side stand-in for the Arduino core, sufficient to build
+// the code beneath `common/` on Linux.
+//
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <functional>
+
+typedef bool boolean;
+
+using std::min;
+using std::max;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+
+#define pgm_read_byte_near(p) (*(const uint8_t *)(p))
+#define PROGMEM
+
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long) {}
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override { fflush(stdout); }
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif /* ARDUINO_H */
@@ -0,0 +1,3 @@
+//
+// Host-side stand-in: nothing from this header is used by `common/`.
+//
@@ -0,0 +1,71 @@
+//
+// Host-side stand-in for the ESP8266 WiFi library.
+//
+// `WiFiClient` is backed by a real (blocking) TCP socket, so code under
+// test talks to genuine servers running on the host.
+//
+#ifndef ESP8266WIFI_H
+#define ESP8266WIFI_H
+
+#include <memory>
+#include "Arduino.h"
+#include "Client.h"
+#include "IPAddress.h"
+
+class WiFiClient : public Client
+{
+public:
+    WiFiClient();
+    virtual ~WiFiClient();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); }
+    void setNoDelay(bool nodelay);
+    using Print::write;
+
+    /*
+     * Counters across every client, so benchmarks can report them.
+     */
+    static unsigned long connects;
+    static unsigned long bytes_read;
+    static unsigned long read_calls;
+
+protected:
+    /*
+     * The socket is shared between copies, as on the device.
+     */
+    std::shared_ptr<int> m_fd;
+    int m_peeked = -1;
+    bool m_eof = false;
+
+    int fd() const { return m_fd ? *m_fd : -1; }
+};
+
+class ESP8266WiFiClass
+{
+public:
+    void macAddress(uint8_t *mac);
+    int hostByName(const char *host, IPAddress &result);
+    int status() { return 3; }
+
+    /*
+     * Count of resolver calls, so DNS caching can be measured.
+     */
+    unsigned long lookups = 0;
+};
+
+#define WL_CONNECTED 3
+
+extern ESP8266WiFiClass WiFi;
+
+#endif /* ESP8266WIFI_H */
@@ -0,0 +1,53 @@
+//
+// Host-side stand-in for the ESP8266 SPIFFS filesystem, backed by a
+// directory on the host (`$HOST_SPIFFS_ROOT`, default "spiffs").
+//
+#ifndef FS_H
+#define FS_H
+
+#include <memory>
+
+#include "Arduino.h"
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File : public Stream
+{
+public:
+    File(FILE *fp = NULL) : m_fp(fp, [](FILE * f) { if (f) fclose(f); }) {}
+
+    operator bool() const { return m_fp.get() != NULL; }
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    size_t read(uint8_t *buf, size_t size);
+    int peek() override;
+    void flush() override;
+    bool seek(uint32_t pos, SeekMode mode = SeekSet);
+    size_t position() const;
+    size_t size() const;
+    void close() { m_fp.reset(); }
+    using Print::write;
+
+private:
+    std::shared_ptr<FILE> m_fp;
+};
+
+class FSClass
+{
+public:
+    bool begin() { return true; }
+    File open(const char *path, const char *mode);
+    File open(const String &path, const char *mode) { return open(path.c_str(), mode); }
+    bool exists(const char *path);
+    bool remove(const char *path);
+    bool rename(const char *from, const char *to);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool remove(const String &path) { return remove(path.c_str()); }
+    bool rename(const String &from, const String &to) { return rename(from.c_str(), to.c_str()); }
+};
+
+extern FSClass SPIFFS;
+
+#endif /* FS_H */
@@ -0,0 +1,35 @@
+//
+// Host-side stand-in for the Arduino `IPAddress` class.
+//
+#ifndef IPADDRESS_H
+#define IPADDRESS_H
+
+#include <stdint.h>
+#include <string.h>
+
+class String;
+
+class IPAddress
+{
+public:
+    IPAddress() { memset(_address, 0, sizeof(_address)); }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    {
+        _address[0] = a;
+        _address[1] = b;
+        _address[2] = c;
+        _address[3] = d;
+    }
+    IPAddress(uint32_t address) { memcpy(_address, &address, 4); }
+
+    operator uint32_t() const { uint32_t a; memcpy(&a, _address, 4); return a; }
+    uint8_t operator[](int index) const { return _address[index]; }
+    uint8_t &operator[](int index) { return _address[index]; }
+    bool isSet() const { return (uint32_t)(*this) != 0; }
+    String toString() const;
+
+private:
+    uint8_t _address[4];
+};
+
+#endif /* IPADDRESS_H */
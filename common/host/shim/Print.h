@@ -0,0 +1,36 @@
+//
+// Host-side stand-in for the Arduino `Print` class.
+//
+#ifndef PRINT_H
+#define PRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class String;
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size);
+    size_t write(const char *str);
+    size_t write(const char *buf, size_t size) { return write((const uint8_t *)buf, size); }
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(const String &str);
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int num);
+    size_t print(unsigned int num);
+    size_t print(long num);
+    size_t print(unsigned long num);
+    size_t print(double num);
+
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+#endif /* PRINT_H */
@@ -0,0 +1,27 @@
+//
+// Host-side stand-in for the Arduino `Stream` class.
+//
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "Print.h"
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    size_t readBytes(char *buffer, size_t length);
+    size_t readBytesUntil(char terminator, char *buffer, size_t length);
+    String readStringUntil(char terminator);
+
+protected:
+    unsigned long _timeout = 1000;
+    int timedRead();
+};
+
+#endif /* STREAM_H */
@@ -0,0 +1,76 @@
+//
+// Host-side stand-in for the Arduino `String` class.
+//
+// Growth behaviour mirrors the ESP8266 core: the buffer is resized to
+// exactly the length required, so allocation counts measured on the host
+// are representative of the device.
+//
+#ifndef WSTRING_H
+#define WSTRING_H
+
+#include <stddef.h>
+
+class String
+{
+public:
+    String(const char *cstr = "");
+    String(const String &str);
+    String(char c);
+    String(int value);
+    String(unsigned int value);
+    String(long value);
+    String(unsigned long value);
+    ~String();
+
+    String &operator = (const String &rhs);
+    String &operator = (const char *cstr);
+
+    unsigned char reserve(unsigned int size);
+    unsigned int length() const { return len; }
+    const char *c_str() const { return buffer ? buffer : ""; }
+    char *begin() { return buffer; }
+
+    unsigned char concat(const String &str);
+    unsigned char concat(const char *cstr);
+    unsigned char concat(const char *cstr, unsigned int length);
+    unsigned char concat(char c);
+    unsigned char concat(int num);
+    unsigned char concat(unsigned long num);
+
+    String &operator += (const String &rhs) { concat(rhs); return *this; }
+    String &operator += (const char *cstr) { concat(cstr); return *this; }
+    String &operator += (char c) { concat(c); return *this; }
+    String &operator += (int num) { concat(num); return *this; }
+    String &operator += (unsigned long num) { concat(num); return *this; }
+
+    friend String operator + (const String &lhs, const String &rhs);
+    friend String operator + (const String &lhs, const char *cstr);
+    friend String operator + (const String &lhs, char c);
+
+    bool operator == (const String &rhs) const;
+    bool operator == (const char *cstr) const;
+    bool operator != (const String &rhs) const { return !(*this == rhs); }
+    bool operator != (const char *cstr) const { return !(*this == cstr); }
+
+    char charAt(unsigned int index) const;
+    char operator [](unsigned int index) const { return charAt(index); }
+    int indexOf(char ch, unsigned int from = 0) const;
+    int indexOf(const char *str, unsigned int from = 0) const;
+    String substring(unsigned int left) const { return substring(left, len); }
+    String substring(unsigned int left, unsigned int right) const;
+    void replace(const char *find, const char *replace);
+    void trim();
+    void toLowerCase();
+    long toInt() const;
+    bool startsWith(const char *prefix) const;
+
+private:
+    char *buffer;
+    unsigned int capacity;
+    unsigned int len;
+
+    unsigned char changeBuffer(unsigned int size);
+    String &copy(const char *cstr, unsigned int length);
+};
+
+#endif /* WSTRING_H */
@@ -0,0 +1,56 @@
+//
+// Host-side stand-in for the BearSSL `WiFiClientSecure`.
+//
+// There is no TLS on the host: connections are plain TCP, so https://
+// URLs should be pointed at the stand-in server.  The configuration
+// calls are recorded so the code driving them can be exercised.
+//
+#ifndef WIFICLIENTSECURE_H
+#define WIFICLIENTSECURE_H
+
+#include "ESP8266WiFi.h"
+
+namespace BearSSL
+{
+
+class Session
+{
+public:
+    Session() : valid(false) {}
+
+    /*
+     * Host-only: set once a connection has used this session.
+     */
+    bool valid;
+};
+
+class WiFiClientSecure : public WiFiClient
+{
+public:
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+
+    void setInsecure() {}
+    void setSession(Session *session) { m_session = session; }
+    void setBufferSizes(int recv, int xmit) { m_recv = recv; m_xmit = xmit; }
+    bool getMFLNStatus() { return m_recv < 16384; }
+
+    /*
+     * Returns true if `HOST_TLS_MFL` is set, and `len` is at least that.
+     */
+    static bool probeMaxFragmentLength(const char *hostname, uint16_t port, uint16_t len);
+
+    static unsigned long handshakes;
+    static unsigned long resumptions;
+
+private:
+    Session *m_session = NULL;
+    int m_recv = 16384;
+    int m_xmit = 16384;
+};
+
+};
+
+using namespace BearSSL;
+
+#endif /* WIFICLIENTSECURE_H */
@@ -0,0 +1,817 @@
+//
+// Implementation of the host-side Arduino stand-ins.
+//
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include "WiFiClientSecure.h"
+#include "FS.h"
+
+
+//
+// Time.
+//
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const uint64_t boot_us = monotonic_us();
+
+unsigned long millis()
+{
+    return (unsigned long)((monotonic_us() - boot_us) / 1000);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)(monotonic_us() - boot_us);
+}
+
+void delay(unsigned long ms)
+{
+    usleep(ms * 1000);
+}
+
+void yield()
+{
+}
+
+long random(long max)
+{
+    return max > 0 ? ::random() % max : 0;
+}
+
+long random(long min, long max)
+{
+    return max > min ? min + random(max - min) : min;
+}
+
+
+//
+// String.
+//
+String::String(const char *cstr) : buffer(NULL), capacity(0), len(0)
+{
+    if (cstr)
+        copy(cstr, strlen(cstr));
+}
+
+String::String(const String &str) : buffer(NULL), capacity(0), len(0)
+{
+    *this = str;
+}
+
+String::String(char c) : buffer(NULL), capacity(0), len(0)
+{
+    char tmp[2] = { c, '\0' };
+    copy(tmp, 1);
+}
+
+String::String(int value) : String((long)value) {}
+String::String(unsigned int value) : String((unsigned long)value) {}
+
+String::String(long value) : buffer(NULL), capacity(0), len(0)
+{
+    char tmp[24];
+    snprintf(tmp, sizeof(tmp), "%ld", value);
+    copy(tmp, strlen(tmp));
+}
+
+String::String(unsigned long value) : buffer(NULL), capacity(0), len(0)
+{
+    char tmp[24];
+    snprintf(tmp, sizeof(tmp), "%lu", value);
+    copy(tmp, strlen(tmp));
+}
+
+String::~String()
+{
+    free(buffer);
+}
+
+unsigned char String::changeBuffer(unsigned int size)
+{
+    char *n = (char *)realloc(buffer, size + 1);
+
+    if (n == NULL)
+        return 0;
+
+    buffer = n;
+    capacity = size;
+    return 1;
+}
+
+unsigned char String::reserve(unsigned int size)
+{
+    if (buffer && capacity >= size)
+        return 1;
+
+    if (!changeBuffer(size))
+        return 0;
+
+    if (len == 0)
+        buffer[0] = '\0';
+
+    return 1;
+}
+
+String &String::copy(const char *cstr, unsigned int length)
+{
+    if (!reserve(length))
+        return *this;
+
+    len = length;
+    memcpy(buffer, cstr, length);
+    buffer[len] = '\0';
+    return *this;
+}
+
+String &String::operator = (const String &rhs)
+{
+    if (this != &rhs)
+        copy(rhs.c_str(), rhs.len);
+
+    return *this;
+}
+
+String &String::operator = (const char *cstr)
+{
+    return copy(cstr ? cstr : "", cstr ? strlen(cstr) : 0);
+}
+
+unsigned char String::concat(const char *cstr, unsigned int length)
+{
+    if (length == 0)
+        return 1;
+
+    if (!reserve(len + length))
+        return 0;
+
+    memmove(buffer + len, cstr, length);
+    len += length;
+    buffer[len] = '\0';
+    return 1;
+}
+
+unsigned char String::concat(const String &str)
+{
+    return concat(str.c_str(), str.len);
+}
+
+unsigned char String::concat(const char *cstr)
+{
+    return cstr ? concat(cstr, strlen(cstr)) : 0;
+}
+
+unsigned char String::concat(char c)
+{
+    return concat(&c, 1);
+}
+
+unsigned char String::concat(int num)
+{
+    return concat(String(num));
+}
+
+unsigned char String::concat(unsigned long num)
+{
+    return concat(String(num));
+}
+
+String operator + (const String &lhs, const String &rhs)
+{
+    String r(lhs);
+    r.concat(rhs);
+    return r;
+}
+
+String operator + (const String &lhs, const char *cstr)
+{
+    String r(lhs);
+    r.concat(cstr);
+    return r;
+}
+
+String operator + (const String &lhs, char c)
+{
+    String r(lhs);
+    r.concat(c);
+    return r;
+}
+
+bool String::operator == (const String &rhs) const
+{
+    return len == rhs.len && strcmp(c_str(), rhs.c_str()) == 0;
+}
+
+bool String::operator == (const char *cstr) const
+{
+    return strcmp(c_str(), cstr ? cstr : "") == 0;
+}
+
+char String::charAt(unsigned int index) const
+{
+    return index < len ? buffer[index] : '\0';
+}
+
+int String::indexOf(char ch, unsigned int from) const
+{
+    if (from >= len)
+        return -1;
+
+    const char *p = strchr(buffer + from, ch);
+    return p ? (int)(p - buffer) : -1;
+}
+
+int String::indexOf(const char *str, unsigned int from) const
+{
+    if (from >= len)
+        return -1;
+
+    const char *p = strstr(buffer + from, str);
+    return p ? (int)(p - buffer) : -1;
+}
+
+String String::substring(unsigned int left, unsigned int right) const
+{
+    if (left > right)
+        std::swap(left, right);
+
+    if (left >= len)
+        return String();
+
+    if (right > len)
+        right = len;
+
+    String r;
+    r.copy(buffer + left, right - left);
+    return r;
+}
+
+void String::replace(const char *find, const char *with)
+{
+    String out;
+    size_t flen = strlen(find);
+    const char *p = c_str();
+    const char *hit;
+
+    while (flen && (hit = strstr(p, find)) != NULL)
+    {
+        out.concat(p, hit - p);
+        out.concat(with);
+        p = hit + flen;
+    }
+
+    out.concat(p);
+    *this = out;
+}
+
+void String::trim()
+{
+    if (!buffer || len == 0)
+        return;
+
+    char *begin = buffer;
+
+    while (isspace(*begin))
+        begin++;
+
+    char *end = buffer + len - 1;
+
+    while (end >= begin && isspace(*end))
+        end--;
+
+    len = end + 1 - begin;
+    memmove(buffer, begin, len);
+    buffer[len] = '\0';
+}
+
+void String::toLowerCase()
+{
+    for (unsigned int i = 0; i < len; i++)
+        buffer[i] = tolower(buffer[i]);
+}
+
+long String::toInt() const
+{
+    return atol(c_str());
+}
+
+bool String::startsWith(const char *prefix) const
+{
+    return strncmp(c_str(), prefix, strlen(prefix)) == 0;
+}
+
+String IPAddress::toString() const
+{
+    char tmp[16];
+    snprintf(tmp, sizeof(tmp), "%d.%d.%d.%d", _address[0], _address[1], _address[2], _address[3]);
+    return String(tmp);
+}
+
+
+//
+// Print / Stream.
+//
+size_t Print::write(const uint8_t *buf, size_t size)
+{
+    size_t n = 0;
+
+    while (size--)
+        n += write(*buf++);
+
+    return n;
+}
+
+size_t Print::write(const char *str)
+{
+    return str ? write((const uint8_t *)str, strlen(str)) : 0;
+}
+
+size_t Print::print(const String &str)
+{
+    return write(str.c_str());
+}
+
+size_t Print::print(int num)
+{
+    return print((long)num);
+}
+
+size_t Print::print(unsigned int num)
+{
+    return print((unsigned long)num);
+}
+
+size_t Print::print(long num)
+{
+    char tmp[24];
+    snprintf(tmp, sizeof(tmp), "%ld", num);
+    return write(tmp);
+}
+
+size_t Print::print(unsigned long num)
+{
+    char tmp[24];
+    snprintf(tmp, sizeof(tmp), "%lu", num);
+    return write(tmp);
+}
+
+size_t Print::print(double num)
+{
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%.2f", num);
+    return write(tmp);
+}
+
+size_t Print::printf(const char *format, ...)
+{
+    char tmp[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(tmp, sizeof(tmp), format, args);
+    va_end(args);
+    return write(tmp);
+}
+
+int Stream::timedRead()
+{
+    unsigned long start = millis();
+
+    do
+    {
+        int c = read();
+
+        if (c >= 0)
+            return c;
+
+        delay(1);
+    }
+    while (millis() - start < _timeout);
+
+    return -1;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    size_t count = 0;
+
+    while (count < length)
+    {
+        int c = timedRead();
+
+        if (c < 0)
+            break;
+
+        buffer[count++] = (char)c;
+    }
+
+    return count;
+}
+
+size_t Stream::readBytesUntil(char terminator, char *buffer, size_t length)
+{
+    size_t count = 0;
+
+    while (count < length)
+    {
+        int c = timedRead();
+
+        if (c < 0 || c == terminator)
+            break;
+
+        buffer[count++] = (char)c;
+    }
+
+    return count;
+}
+
+String Stream::readStringUntil(char terminator)
+{
+    String ret;
+    int c = timedRead();
+
+    while (c >= 0 && c != terminator)
+    {
+        ret += (char)c;
+        c = timedRead();
+    }
+
+    return ret;
+}
+
+HardwareSerial Serial;
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t size)
+{
+    return fwrite(buf, 1, size, stdout);
+}
+
+
+//
+// WiFi.
+//
+ESP8266WiFiClass WiFi;
+
+void ESP8266WiFiClass::macAddress(uint8_t *mac)
+{
+    static const uint8_t host[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    memcpy(mac, host, sizeof(host));
+}
+
+int ESP8266WiFiClass::hostByName(const char *host, IPAddress &result)
+{
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    lookups++;
+
+    if (getenv("HOST_DNS_FAIL") && access(getenv("HOST_DNS_FAIL"), F_OK) == 0)
+        return 0;
+
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL)
+        return 0;
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)res->ai_addr;
+    result = IPAddress((uint32_t)sin->sin_addr.s_addr);
+    freeaddrinfo(res);
+    return 1;
+}
+
+unsigned long WiFiClient::connects = 0;
+unsigned long WiFiClient::bytes_read = 0;
+unsigned long WiFiClient::read_calls = 0;
+
+WiFiClient::WiFiClient()
+{
+}
+
+WiFiClient::~WiFiClient()
+{
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+    stop();
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (s < 0)
+        return 0;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = (uint32_t)ip;
+
+    if (::connect(s, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+    {
+        close(s);
+        return 0;
+    }
+
+    m_fd = std::shared_ptr<int>(new int(s), [](int *p) { close(*p); delete p; });
+    m_peeked = -1;
+    m_eof = false;
+    connects++;
+    return 1;
+}
+
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+    IPAddress ip;
+
+    if (!WiFi.hostByName(host, ip))
+        return 0;
+
+    return connect(ip, port);
+}
+
+size_t WiFiClient::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t WiFiClient::write(const uint8_t *buf, size_t size)
+{
+    if (fd() < 0)
+        return 0;
+
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t n = send(fd(), buf + done, size - done, MSG_NOSIGNAL);
+
+        if (n <= 0)
+            break;
+
+        done += n;
+    }
+
+    return done;
+}
+
+int WiFiClient::available()
+{
+    if (fd() < 0)
+        return m_peeked >= 0 ? 1 : 0;
+
+    int n = 0;
+    ioctl(fd(), FIONREAD, &n);
+
+    if (n == 0 && !m_eof)
+    {
+        //
+        // Detect an orderly shutdown by the peer.
+        //
+        struct pollfd p = { fd(), POLLIN, 0 };
+
+        if (poll(&p, 1, 0) == 1 && (p.revents & (POLLIN | POLLHUP)))
+        {
+            ioctl(fd(), FIONREAD, &n);
+
+            if (n == 0)
+                m_eof = true;
+        }
+    }
+
+    return n + (m_peeked >= 0 ? 1 : 0);
+}
+
+int WiFiClient::read()
+{
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+
+    if (size == 0)
+        return 0;
+
+    if (m_peeked >= 0)
+    {
+        buf[done++] = (uint8_t)m_peeked;
+        m_peeked = -1;
+    }
+
+    int avail = available();
+
+    if (fd() >= 0 && done < size && avail > 0)
+    {
+        ssize_t n = recv(fd(), buf + done, min((size_t)avail, size - done), 0);
+
+        if (n > 0)
+            done += n;
+    }
+
+    read_calls++;
+    bytes_read += done;
+    return done > 0 ? (int)done : -1;
+}
+
+int WiFiClient::peek()
+{
+    if (m_peeked < 0)
+    {
+        uint8_t c;
+
+        if (available() > 0 && recv(fd(), &c, 1, 0) == 1)
+            m_peeked = c;
+    }
+
+    return m_peeked;
+}
+
+void WiFiClient::stop()
+{
+    m_fd.reset();
+    m_peeked = -1;
+    m_eof = false;
+}
+
+uint8_t WiFiClient::connected()
+{
+    if (fd() < 0)
+        return 0;
+
+    //
+    // Like the device, we're connected while data remains unread.
+    //
+    return (available() > 0 || !m_eof) ? 1 : 0;
+}
+
+void WiFiClient::setNoDelay(bool nodelay)
+{
+    int v = nodelay ? 1 : 0;
+
+    if (fd() >= 0)
+        setsockopt(fd(), IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+}
+
+unsigned long BearSSL::WiFiClientSecure::handshakes = 0;
+unsigned long BearSSL::WiFiClientSecure::resumptions = 0;
+
+int BearSSL::WiFiClientSecure::connect(IPAddress ip, uint16_t port)
+{
+    if (!WiFiClient::connect(ip, port))
+        return 0;
+
+    if (m_session && m_session->valid)
+        resumptions++;
+    else
+        handshakes++;
+
+    if (m_session)
+        m_session->valid = true;
+
+    return 1;
+}
+
+int BearSSL::WiFiClientSecure::connect(const char *host, uint16_t port)
+{
+    IPAddress ip;
+
+    if (!WiFi.hostByName(host, ip))
+        return 0;
+
+    return connect(ip, port);
+}
+
+bool BearSSL::WiFiClientSecure::probeMaxFragmentLength(const char *, uint16_t, uint16_t len)
+{
+    const char *mfl = getenv("HOST_TLS_MFL");
+    return mfl != NULL && len >= atoi(mfl);
+}
+
+
+//
+// SPIFFS.
+//
+FSClass SPIFFS;
+
+static String spiffs_path(const char *path)
+{
+    const char *root = getenv("HOST_SPIFFS_ROOT");
+    String p(root ? root : "spiffs");
+    mkdir(p.c_str(), 0755);
+    p += path;
+    return p;
+}
+
+File FSClass::open(const char *path, const char *mode)
+{
+    String p = spiffs_path(path);
+    char m[4] = { mode[0], 'b', '\0', '\0' };
+
+    if (mode[0] != 'r' || strchr(mode, '+'))
+        m[2] = '+';
+
+    return File(fopen(p.c_str(), m));
+}
+
+bool FSClass::exists(const char *path)
+{
+    struct stat st;
+    return stat(spiffs_path(path).c_str(), &st) == 0;
+}
+
+bool FSClass::remove(const char *path)
+{
+    return ::unlink(spiffs_path(path).c_str()) == 0;
+}
+
+bool FSClass::rename(const char *from, const char *to)
+{
+    return ::rename(spiffs_path(from).c_str(), spiffs_path(to).c_str()) == 0;
+}
+
+size_t File::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t File::write(const uint8_t *buf, size_t size)
+{
+    return m_fp ? fwrite(buf, 1, size, m_fp.get()) : 0;
+}
+
+int File::available()
+{
+    return m_fp ? (int)(size() - position()) : 0;
+}
+
+int File::read()
+{
+    return m_fp ? fgetc(m_fp.get()) : -1;
+}
+
+size_t File::read(uint8_t *buf, size_t size)
+{
+    return m_fp ? fread(buf, 1, size, m_fp.get()) : 0;
+}
+
+int File::peek()
+{
+    if (!m_fp)
+        return -1;
+
+    int c = fgetc(m_fp.get());
+
+    if (c != EOF)
+        ungetc(c, m_fp.get());
+
+    return c;
+}
+
+void File::flush()
+{
+    if (m_fp)
+        fflush(m_fp.get());
+}
+
+bool File::seek(uint32_t pos, SeekMode mode)
+{
+    return m_fp && fseek(m_fp.get(), pos, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) == 0;
+}
+
+size_t File::position() const
+{
+    return m_fp ? ftell(m_fp.get()) : 0;
+}
+
+size_t File::size() const
+{
+    if (!m_fp)
+        return 0;
+
+    struct stat st;
+    fflush(m_fp.get());
+    fstat(fileno(m_fp.get()), &st);
+    return st.st_size;
+}
@@ -0,0 +1,164 @@
+//
+// Benchmark the URL-decoding of `url_parameters.h` on the host.
+//
+// We compare `url_decode()`, which works in place a word at a time,
+// with the byte-at-a-time version URL used to have, which allocated
+// its result, and time `url_encode()` too.
+//
+// Usage:
+//
+//    ./url_decode_bench [iterations]
+//
+// See README.md for how to build it.
+//
+#include <time.h>
+
+#include "url_parameters.h"
+
+
+//
+// The decoder URL used to have, for comparison.
+//
+static char *old_urldecode(const char *url)
+{
+    int s = 0, d = 0, url_len = 0;
+    char c;
+    char *dest = NULL;
+
+    if (!url)
+        return NULL;
+
+    url_len = strlen(url) + 1;
+    dest = (char *)malloc(url_len);
+
+    if (!dest)
+        return NULL;
+
+    while (s < url_len)
+    {
+        c = url[s++];
+
+        if (c == '%' && s + 2 < url_len)
+        {
+            char c2 = url[s++];
+            char c3 = url[s++];
+
+            if (isxdigit(c2) && isxdigit(c3))
+            {
+                c2 = tolower(c2);
+                c3 = tolower(c3);
+
+                if (c2 <= '9')
+                    c2 = c2 - '0';
+                else
+                    c2 = c2 - 'a' + 10;
+
+                if (c3 <= '9')
+                    c3 = c3 - '0';
+                else
+                    c3 = c3 - 'a' + 10;
+
+                dest[d++] = 16 * c2 + c3;
+            }
+            else
+            {
+                dest[d++] = c;
+                dest[d++] = c2;
+                dest[d++] = c3;
+            }
+        }
+        else if (c == '+')
+        {
+            dest[d++] = ' ';
+        }
+        else
+        {
+            dest[d++] = c;
+        }
+    }
+
+    return dest;
+}
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char *argv[])
+{
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    const char *inputs[] =
+    {
+        "1160404",
+        "https://api.steve.fi/Helsinki-Transport/data/__ID__",
+        "Hello+world%21+This+is+a+message+for+the+display",
+        "%2F%2F%3A%3F%26%3D%2B%24%2C%23%40%21%7E%2A%27%28%29",
+    };
+
+    printf("%-52s %10s %10s %10s\n", "input", "old ns", "new ns", "encode ns");
+
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++)
+    {
+        const char *input = inputs[i];
+        size_t len = strlen(input);
+        char buf[256];
+        char encoded[768];
+        volatile size_t sink = 0;
+
+        //
+        // Both decoders must agree.
+        //
+        char *expected = old_urldecode(input);
+        memcpy(buf, input, len + 1);
+        url_decode(buf);
+
+        if (strcmp(expected, buf) != 0)
+        {
+            printf("MISMATCH: '%s' gave '%s', expected '%s'\n", input, buf, expected);
+            return 1;
+        }
+
+        free(expected);
+
+        double start = now();
+
+        for (long n = 0; n < iterations; n++)
+        {
+            char *out = old_urldecode(input);
+            sink += out[0];
+            free(out);
+        }
+
+        double old_ns = (now() - start) * 1e9 / iterations;
+
+        //
+        // The copy is part of the cost, as we decode in place.
+        //
+        start = now();
+
+        for (long n = 0; n < iterations; n++)
+        {
+            memcpy(buf, input, len + 1);
+            sink += url_decode(buf);
+        }
+
+        double new_ns = (now() - start) * 1e9 / iterations;
+
+        start = now();
+
+        for (long n = 0; n < iterations; n++)
+            sink += url_encode(input, encoded, sizeof(encoded));
+
+        double encode_ns = (now() - start) * 1e9 / iterations;
+
+        printf("%-52.52s %10.1f %10.1f %10.1f\n", input, old_ns, new_ns, encode_ns);
+    }
+
+    return 0;
+}
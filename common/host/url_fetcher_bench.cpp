@@ -0,0 +1,206 @@
+//
+// Benchmark UrlFetcher on the host, against real sockets.
+//
+// Each URL is fetched repeatedly, and we report the wall time, the
+// throughput of the body, and how many allocations each fetch made.
+//
+// Usage:
+//
+//    ./url_fetcher_bench [-n count] [-k] [-s] [-z] [-t ms] [-r attempts] [-d path]
+//                        [-x complete] url ..
+//
+//    -n  The number of times to fetch each URL, default 20.
+//    -k  Use keep-alive, so connections are reused.
+//    -s  Store the body, rather than streaming it to a handler.
+//    -z  Ask for the body to be compressed.
+//    -t  The timeout of each fetch, in milliseconds.
+//    -r  The number of attempts to make at each fetch.
+//    -d  Download the body to this file, in the shim's SPIFFS.
+//    -x  Fail unless this many fetches of each URL are complete.
+//
+// See README.md for how to build it, and the server to run it against.
+//
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include "FS.h"
+#include "url_fetcher.h"
+
+
+//
+// Count every allocation, by wrapping the C library's allocator.  The
+// operator new of libstdc++ uses malloc, so that is counted too.
+//
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long g_allocs = 0;
+static unsigned long g_alloc_bytes = 0;
+
+extern "C" void *malloc(size_t size)
+{
+    g_allocs += 1;
+    g_alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    g_allocs += 1;
+    g_alloc_bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    g_allocs += 1;
+    g_alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int count = 20;
+    bool keep_alive = false;
+    bool store = false;
+    bool compress = false;
+    unsigned long timeout = 0;
+    int attempts = 0;
+    const char *path = NULL;
+    int expected = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:kszt:r:d:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+
+        case 'k':
+            keep_alive = true;
+            break;
+
+        case 's':
+            store = true;
+            break;
+
+        case 'z':
+            compress = true;
+            break;
+
+        case 't':
+            timeout = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'r':
+            attempts = atoi(optarg);
+            break;
+
+        case 'd':
+            path = optarg;
+            break;
+
+        case 'x':
+            expected = atoi(optarg);
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-n count] [-k] [-s] [-z] [-t ms] [-r attempts] [-d path] [-x complete] url ..\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-40s %5s %5s %9s %9s %10s %8s %10s %6s\n",
+           "url", "code", "ok", "bytes", "ms/fetch", "KB/s", "allocs", "alloc-KB", "conns");
+
+    for (int i = optind; i < argc; i++)
+    {
+        const char *url = argv[i];
+        unsigned long bytes = 0;
+        int complete = 0;
+        int code = 0;
+
+        unsigned long connects = WiFiClient::connects;
+        unsigned long allocs = g_allocs;
+        unsigned long alloc_bytes = g_alloc_bytes;
+        unsigned long started = micros();
+
+        for (int n = 0; n < count; n++)
+        {
+            UrlFetcher fetcher(url);
+            fetcher.setKeepAlive(keep_alive);
+            fetcher.setCompression(compress);
+
+            if (timeout)
+                fetcher.setTimeout(timeout);
+
+            if (attempts)
+                fetcher.setRetries(attempts, 100, 400);
+
+            if (path)
+            {
+                //
+                // A download only counts as complete if the file is
+                // there at the end.
+                //
+                SPIFFS.remove(path);
+                fetcher.download(path);
+
+                File f = SPIFFS.open(path, "r");
+
+                if (f)
+                    bytes += f.size();
+
+                complete += f ? 1 : 0;
+                code = fetcher.code();
+                continue;
+            }
+            else if (store)
+            {
+                bytes += fetcher.body().length();
+            }
+            else
+            {
+                fetcher.stream([&](const uint8_t *, size_t len)
+                {
+                    bytes += len;
+                });
+            }
+
+            code = fetcher.code();
+            complete += fetcher.complete() ? 1 : 0;
+        }
+
+        unsigned long elapsed = micros() - started;
+
+        //
+        // Keep-alive connections left in the pool aren't part of the
+        // next URL's figures.
+        //
+        UrlFetcher::closeIdle(true);
+
+        double secs = elapsed / 1000000.0;
+
+        printf("%-40s %5d %5d %9lu %9.2f %10.1f %8.1f %10.1f %6lu\n",
+               url, code, complete, bytes / count,
+               elapsed / 1000.0 / count,
+               secs > 0 ? bytes / 1024.0 / secs : 0,
+               (double)(g_allocs - allocs) / count,
+               (double)(g_alloc_bytes - alloc_bytes) / 1024.0 / count,
+               WiFiClient::connects - connects);
+
+        if (expected >= 0 && complete != expected)
+        {
+            printf("FAILED: %s: %d of %d fetches complete, expected %d\n",
+                   url, complete, count, expected);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,892 @@
+//
+// Basic types
+//
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Our header.
+//
+#include "inflater.h"
+
+
+/*
+ * The base-values, and number of extra bits, of the length & distance
+ * symbols.
+ */
+static const uint16_t length_base[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t length_extra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t distance_base[30] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+static const uint8_t distance_extra[30] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/*
+ * The order in which the lengths of the code-length code are sent.
+ */
+static const uint8_t code_order[19] =
+{
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/*
+ * The CRC-32 of each nibble, for the gzip checksum.
+ */
+static const uint32_t crc_table[16] =
+{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+
+/*
+ * Constructor.  Called with the size of our window, which must be
+ * a power of two.
+ */
+Inflater::Inflater(size_t window)
+{
+    m_window_size = window;
+    m_lencode.symbols = m_lensym;
+    m_distcode.symbols = m_distsym;
+}
+
+
+/*
+ * Destructor.
+ *
+ * Free our window.
+ */
+Inflater::~Inflater()
+{
+    if (m_window)
+    {
+        free(m_window);
+        m_window = NULL;
+    }
+}
+
+
+/*
+ * Prepare to decompress a new stream.
+ */
+bool Inflater::begin(format_t format, InflaterHandler handler)
+{
+    if (m_window == NULL)
+        m_window = (uint8_t *)malloc(m_window_size);
+
+    if (m_window == NULL)
+    {
+        m_state = FAILED;
+        return false;
+    }
+
+    m_format  = format;
+    m_handler = handler;
+    m_bits    = 0;
+    m_nbits   = 0;
+    m_pos     = 0;
+    m_flushed = 0;
+    m_count   = 0;
+    m_final   = false;
+
+    if (format == GZIP)
+    {
+        m_state = GZIP_HEADER;
+        m_check = 0xffffffff;
+    }
+    else if (format == ZLIB)
+    {
+        m_state = ZLIB_HEADER;
+        m_check = 1;
+    }
+    else
+    {
+        m_state = BLOCK_HEADER;
+    }
+
+    return true;
+}
+
+
+/*
+ * Decompress some more of the stream.
+ */
+bool Inflater::write(const uint8_t *data, size_t len)
+{
+    if (m_state == FAILED)
+        return false;
+
+    m_in = data;
+    m_in_end = data + len;
+
+    inflate();
+    flush();
+
+    m_in = m_in_end = NULL;
+    return (m_state != FAILED);
+}
+
+
+/*
+ * Have we reached the end of the stream?
+ */
+bool Inflater::finished()
+{
+    return (m_state == DONE);
+}
+
+
+/*
+ * Did the decompression fail?
+ */
+bool Inflater::failed()
+{
+    return (m_state == FAILED);
+}
+
+
+/*
+ * The number of bytes we've decompressed.
+ */
+unsigned long Inflater::total()
+{
+    return (m_pos);
+}
+
+
+/*
+ * Load whole bytes into our bit-buffer, and see if we have enough.
+ */
+bool Inflater::need(int n)
+{
+    while (m_nbits <= 24 && m_in < m_in_end)
+    {
+        m_bits |= (uint32_t)(*m_in++) << m_nbits;
+        m_nbits += 8;
+    }
+
+    return (m_nbits >= n);
+}
+
+
+/*
+ * Remove `n` bits from our bit-buffer.
+ */
+uint32_t Inflater::bits(int n)
+{
+    uint32_t value = m_bits & ((1UL << n) - 1);
+
+    m_bits >>= n;
+    m_nbits -= n;
+    return (value);
+}
+
+
+/*
+ * Decode a symbol, a bit at a time.
+ *
+ * The codes of each length are consecutive, so we only need to know
+ * how many there are of each length to find the symbol.  No bits are
+ * removed unless we find a complete code.
+ */
+int Inflater::decode(huffman_t *code)
+{
+    int value = 0;
+    int first = 0;
+    int index = 0;
+
+    need(15);
+
+    for (int len = 1; len < 16; len++)
+    {
+        if (len > m_nbits)
+            return -1;
+
+        value |= (m_bits >> (len - 1)) & 1;
+
+        int count = code->counts[len];
+
+        if (value - first < count)
+        {
+            bits(len);
+            return code->symbols[index + value - first];
+        }
+
+        index += count;
+        first += count;
+        first <<= 1;
+        value <<= 1;
+    }
+
+    return -2;
+}
+
+
+/*
+ * Build a code from the lengths of the codes of each symbol.
+ */
+void Inflater::build(huffman_t *code, const uint8_t *lengths, int count)
+{
+    uint16_t offsets[16];
+
+    memset(code->counts, 0, sizeof(code->counts));
+
+    for (int i = 0; i < count; i++)
+        code->counts[lengths[i]] += 1;
+
+    code->counts[0] = 0;
+    offsets[1] = 0;
+
+    for (int len = 1; len < 15; len++)
+        offsets[len + 1] = offsets[len] + code->counts[len];
+
+    for (int i = 0; i < count; i++)
+    {
+        if (lengths[i] != 0)
+            code->symbols[offsets[lengths[i]]++] = i;
+    }
+}
+
+
+/*
+ * Append a byte to our output.
+ *
+ * When we reach the end of the window we pass its contents on, before
+ * they're overwritten.
+ */
+void Inflater::output(uint8_t c)
+{
+    m_window[m_pos & (m_window_size - 1)] = c;
+    m_pos += 1;
+
+    if ((m_pos & (m_window_size - 1)) == 0)
+        flush();
+}
+
+
+/*
+ * Copy some of our previous output.
+ */
+bool Inflater::copy(uint32_t distance, uint32_t length)
+{
+    if (distance > m_pos || distance > m_window_size)
+        return false;
+
+    while (length-- > 0)
+        output(m_window[(m_pos - distance) & (m_window_size - 1)]);
+
+    return true;
+}
+
+
+/*
+ * Pass our new output to the handler, updating our checksum.
+ *
+ * We flush whenever we reach the end of the window, so the output
+ * is never split across it.
+ */
+void Inflater::flush()
+{
+    uint32_t len = m_pos - m_flushed;
+
+    if (len == 0)
+        return;
+
+    const uint8_t *data = m_window + (m_flushed & (m_window_size - 1));
+
+    if (m_format == GZIP)
+    {
+        for (uint32_t i = 0; i < len; i++)
+        {
+            m_check ^= data[i];
+            m_check = (m_check >> 4) ^ crc_table[m_check & 15];
+            m_check = (m_check >> 4) ^ crc_table[m_check & 15];
+        }
+    }
+    else if (m_format == ZLIB)
+    {
+        //
+        // Adler-32, reducing the sums often enough that they can't
+        // overflow.
+        //
+        uint32_t a = m_check & 0xffff;
+        uint32_t b = m_check >> 16;
+
+        for (uint32_t i = 0; i < len; i++)
+        {
+            a += data[i];
+            b += a;
+
+            if ((i & 4095) == 4095)
+            {
+                a %= 65521;
+                b %= 65521;
+            }
+        }
+
+        m_check = ((b % 65521) << 16) | (a % 65521);
+    }
+
+    m_flushed = m_pos;
+
+    if (m_handler)
+        m_handler(data, len);
+}
+
+
+/*
+ * Decompress as much of our input as we can.
+ *
+ * Each state only removes bits from the buffer once it has all it
+ * needs, so when we run out of input we can return, and resume in
+ * the same state when we're given more.
+ */
+void Inflater::inflate()
+{
+    while (true)
+    {
+        switch (m_state)
+        {
+        case GZIP_HEADER:
+        {
+            //
+            // The fixed ten-byte header; magic, method, & flags.
+            //
+            if (! need(8))
+                return;
+
+            int c = bits(8);
+
+            if ((m_count == 0 && c != 0x1f) ||
+                    (m_count == 1 && c != 0x8b) ||
+                    (m_count == 2 && c != 8))
+            {
+                m_state = FAILED;
+                break;
+            }
+
+            if (m_count == 3)
+                m_flags = c;
+
+            if (++m_count == 10)
+            {
+                m_count = 0;
+                m_length = 0;
+                m_state = GZIP_EXTRA_LENGTH;
+            }
+
+            break;
+        }
+
+        case GZIP_EXTRA_LENGTH:
+            if (! (m_flags & 4))
+            {
+                m_state = GZIP_NAME;
+                break;
+            }
+
+            if (! need(16))
+                return;
+
+            m_length = bits(16);
+            m_state = GZIP_EXTRA;
+            break;
+
+        case GZIP_EXTRA:
+            if (m_length == 0)
+            {
+                m_state = GZIP_NAME;
+                break;
+            }
+
+            if (! need(8))
+                return;
+
+            bits(8);
+            m_length -= 1;
+            break;
+
+        case GZIP_NAME:
+        case GZIP_COMMENT:
+        {
+            //
+            // Optional NUL-terminated strings.
+            //
+            int flag = (m_state == GZIP_NAME) ? 8 : 16;
+
+            if (m_flags & flag)
+            {
+                if (! need(8))
+                    return;
+
+                if (bits(8) != 0)
+                    break;
+            }
+
+            m_state = (m_state == GZIP_NAME) ? GZIP_COMMENT : GZIP_HEADER_CRC;
+            break;
+        }
+
+        case GZIP_HEADER_CRC:
+            if (m_flags & 2)
+            {
+                if (! need(16))
+                    return;
+
+                bits(16);
+            }
+
+            m_state = BLOCK_HEADER;
+            break;
+
+        case ZLIB_HEADER:
+        {
+            if (! need(16))
+                return;
+
+            //
+            // If this isn't a valid zlib header then we assume the
+            // stream is raw deflate data.
+            //
+            uint32_t header = ((m_bits & 0xff) << 8) | ((m_bits >> 8) & 0xff);
+
+            if ((m_bits & 0x0f) != 8 || header % 31 != 0 || (header & 0x20))
+            {
+                m_format = RAW;
+            }
+            else
+            {
+                bits(16);
+            }
+
+            m_state = BLOCK_HEADER;
+            break;
+        }
+
+        case BLOCK_HEADER:
+        {
+            if (! need(3))
+                return;
+
+            m_final = bits(1);
+
+            int type = bits(2);
+
+            if (type == 0)
+            {
+                m_state = STORED_LENGTH;
+            }
+            else if (type == 1)
+            {
+                //
+                // The fixed codes.
+                //
+                for (int i = 0; i < 288; i++)
+                    m_lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+
+                build(&m_lencode, m_lengths, 288);
+
+                for (int i = 0; i < 30; i++)
+                    m_lengths[i] = 5;
+
+                build(&m_distcode, m_lengths, 30);
+                m_state = LENGTH;
+            }
+            else if (type == 2)
+            {
+                m_state = TABLE_SIZES;
+            }
+            else
+            {
+                m_state = FAILED;
+            }
+
+            break;
+        }
+
+        case STORED_LENGTH:
+        {
+            //
+            // Skip to a byte-boundary, then the length and its complement.
+            //
+            bits(m_nbits & 7);
+
+            if (! need(32))
+                return;
+
+            uint32_t len = bits(16);
+
+            if ((len ^ bits(16)) != 0xffff)
+            {
+                m_state = FAILED;
+                break;
+            }
+
+            m_length = len;
+            m_state = STORED_DATA;
+            break;
+        }
+
+        case STORED_DATA:
+        {
+            //
+            // Use what's left in the bit-buffer first, then copy
+            // straight from the input.
+            //
+            while (m_length > 0 && m_nbits >= 8)
+            {
+                output(bits(8));
+                m_length -= 1;
+            }
+
+            while (m_length > 0 && m_in < m_in_end)
+            {
+                uint32_t n = m_in_end - m_in;
+                uint32_t space = m_window_size - (m_pos & (m_window_size - 1));
+
+                if (n > m_length)
+                    n = m_length;
+
+                if (n > space)
+                    n = space;
+
+                memcpy(m_window + (m_pos & (m_window_size - 1)), m_in, n);
+                m_in += n;
+                m_pos += n;
+                m_length -= n;
+
+                if ((m_pos & (m_window_size - 1)) == 0)
+                    flush();
+            }
+
+            if (m_length > 0)
+                return;
+
+            m_state = m_final ? TRAILER : BLOCK_HEADER;
+            m_count = 0;
+            break;
+        }
+
+        case TABLE_SIZES:
+            if (! need(14))
+                return;
+
+            m_nlen  = bits(5) + 257;
+            m_ndist = bits(5) + 1;
+            m_ncode = bits(4) + 4;
+
+            if (m_nlen > 286 || m_ndist > 30)
+            {
+                m_state = FAILED;
+                break;
+            }
+
+            memset(m_lengths, 0, sizeof(m_lengths));
+            m_count = 0;
+            m_state = TABLE_CODES;
+            break;
+
+        case TABLE_CODES:
+            //
+            // The lengths of the code used for the code-lengths.
+            //
+            while (m_count < m_ncode)
+            {
+                if (! need(3))
+                    return;
+
+                m_lengths[code_order[m_count++]] = bits(3);
+            }
+
+            //
+            // We decode the lengths with the distance-code, which
+            // isn't needed until they're complete.
+            //
+            build(&m_distcode, m_lengths, 19);
+            memset(m_lengths, 0, sizeof(m_lengths));
+            m_count = 0;
+            m_state = TABLE_LENGTHS;
+            break;
+
+        case TABLE_LENGTHS:
+        {
+            if (m_count == m_nlen + m_ndist)
+            {
+                //
+                // Without an end-of-block code the block can't end.
+                //
+                if (m_lengths[256] == 0)
+                {
+                    m_state = FAILED;
+                    break;
+                }
+
+                build(&m_lencode, m_lengths, m_nlen);
+                build(&m_distcode, m_lengths + m_nlen, m_ndist);
+                m_state = LENGTH;
+                break;
+            }
+
+            int symbol = decode(&m_distcode);
+
+            if (symbol == -1)
+                return;
+
+            if (symbol < 0)
+            {
+                m_state = FAILED;
+            }
+            else if (symbol < 16)
+            {
+                m_lengths[m_count++] = symbol;
+            }
+            else if (symbol == 16 && m_count == 0)
+            {
+                m_state = FAILED;
+            }
+            else
+            {
+                m_symbol = symbol;
+                m_state = TABLE_REPEAT;
+            }
+
+            break;
+        }
+
+        case TABLE_REPEAT:
+        {
+            //
+            // Repeat the previous length, or zero.
+            //
+            static const uint8_t extra[3] = { 2, 3, 7 };
+            static const uint8_t base[3] = { 3, 3, 11 };
+
+            int n = m_symbol - 16;
+
+            if (! need(extra[n]))
+                return;
+
+            int repeat = base[n] + bits(extra[n]);
+            uint8_t len = (n == 0) ? m_lengths[m_count - 1] : 0;
+
+            if (m_count + repeat > m_nlen + m_ndist)
+            {
+                m_state = FAILED;
+                break;
+            }
+
+            while (repeat-- > 0)
+                m_lengths[m_count++] = len;
+
+            m_state = TABLE_LENGTHS;
+            break;
+        }
+
+        case LENGTH:
+        {
+            int symbol = decode(&m_lencode);
+
+            if (symbol == -1)
+                return;
+
+            if (symbol < 0 || symbol > 285)
+            {
+                m_state = FAILED;
+            }
+            else if (symbol < 256)
+            {
+                output(symbol);
+            }
+            else if (symbol == 256)
+            {
+                m_state = m_final ? TRAILER : BLOCK_HEADER;
+                m_count = 0;
+            }
+            else
+            {
+                m_length = length_base[symbol - 257];
+                m_extra  = length_extra[symbol - 257];
+                m_state  = LENGTH_EXTRA;
+            }
+
+            break;
+        }
+
+        case LENGTH_EXTRA:
+            if (! need(m_extra))
+                return;
+
+            m_length += bits(m_extra);
+            m_state = DISTANCE;
+            break;
+
+        case DISTANCE:
+        {
+            int symbol = decode(&m_distcode);
+
+            if (symbol == -1)
+                return;
+
+            if (symbol < 0 || symbol > 29)
+            {
+                m_state = FAILED;
+                break;
+            }
+
+            m_distance = distance_base[symbol];
+            m_extra    = distance_extra[symbol];
+            m_state    = DISTANCE_EXTRA;
+            break;
+        }
+
+        case DISTANCE_EXTRA:
+            if (! need(m_extra))
+                return;
+
+            m_distance += bits(m_extra);
+
+            if (! copy(m_distance, m_length))
+            {
+                m_state = FAILED;
+                break;
+            }
+
+            m_state = LENGTH;
+            break;
+
+        case TRAILER:
+        {
+            //
+            // The checksum follows on the next byte-boundary; gzip has
+            // the CRC-32 and length, least-significant byte first, and
+            // zlib has the Adler-32, most-significant byte first.
+            //
+            int size = (m_format == GZIP) ? 8 : (m_format == ZLIB) ? 4 : 0;
+
+            bits(m_nbits & 7);
+
+            while (m_count < size)
+            {
+                if (! need(8))
+                    return;
+
+                m_trailer[m_count++] = bits(8);
+            }
+
+            flush();
+
+            uint32_t expected = 0;
+            uint32_t actual = 0;
+
+            if (m_format == GZIP)
+            {
+                expected = m_trailer[0] | (m_trailer[1] << 8) | (m_trailer[2] << 16) | ((uint32_t)m_trailer[3] << 24);
+                actual = ~m_check;
+
+                uint32_t size = m_trailer[4] | (m_trailer[5] << 8) | (m_trailer[6] << 16) | ((uint32_t)m_trailer[7] << 24);
+
+                if (size != m_pos)
+                    actual = ~expected;
+            }
+            else if (m_format == ZLIB)
+            {
+                expected = ((uint32_t)m_trailer[0] << 24) | (m_trailer[1] << 16) | (m_trailer[2] << 8) | m_trailer[3];
+                actual = m_check;
+            }
+
+            m_state = (expected == actual) ? DONE : FAILED;
+            break;
+        }
+
+        case DONE:
+        case FAILED:
+            return;
+        }
+    }
+}
+
+
+#ifdef INFLATER_BENCHMARK
+
+/*
+ * Decompress a gzip file on a normal machine, a few bytes at a time as
+ * they might arrive over the network, and time it:
+ *
+ *   g++ -O2 -DINFLATER_BENCHMARK -o inflater inflater.cpp
+ *   ./inflater departures.csv.gz 512 4096
+ *
+ * The stream must have been compressed with a window no larger than
+ * ours, e.g. `gzip_window 4k` for nginx.
+ */
+#include <stdio.h>
+#include <time.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s file.gz [chunk-size] [window]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+
+    if (f == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    static uint8_t input[1 << 20];
+    size_t len = fread(input, 1, sizeof(input), f);
+    fclose(f);
+
+    size_t chunk = (argc > 2) ? atoi(argv[2]) : 512;
+    int rounds = 100;
+    unsigned long output = 0;
+    bool ok = true;
+
+    Inflater inf((argc > 3) ? atoi(argv[3]) : INFLATER_WINDOW);
+    clock_t start = clock();
+
+    for (int i = 0; i < rounds; i++)
+    {
+        inf.begin(Inflater::GZIP, [&](const uint8_t * data, size_t n)
+        {
+            output += n;
+        });
+
+        for (size_t offset = 0; offset < len; offset += chunk)
+            inf.write(input + offset, (len - offset < chunk) ? len - offset : chunk);
+
+        ok = ok && inf.finished();
+    }
+
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%s: %zu -> %lu bytes, %s, %.1f MB/s output\n", argv[1], len,
+           output / rounds, ok ? "OK" : "FAILED", output / secs / 1e6);
+    return ok ? 0 : 1;
+}
+
+#endif
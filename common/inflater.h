@@ -0,0 +1,252 @@
+#ifndef INFLATER_H
+#define INFLATER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+/*
+ * This is a streaming decompressor for the "deflate" format, which is
+ * used by gzip & zlib - and so by HTTP's `Content-Encoding`.
+ *
+ * The compressed data may be given to us in pieces of any size, and
+ * the decompressed data is passed to a handler as it is produced:
+ *
+ *    Inflater inf;
+ *
+ *    inf.begin( Inflater::GZIP, [](const uint8_t *data, size_t len) {
+ *        Serial.write(data, len);
+ *    });
+ *
+ *    inf.write( compressed, len );
+ *
+ *    if ( inf.finished() ) ..
+ *
+ * The format allows data to refer back to the previous 32k of output,
+ * but we only keep a small window of it so that we don't run out of
+ * RAM.  Data which refers further back than that is reported as an
+ * error.  That can never happen for output smaller than the window,
+ * and for larger output the server must be configured to compress
+ * with a window no larger than ours (e.g. nginx's `gzip_window`).
+ *
+ * There is nothing Arduino-specific here, so this may be compiled and
+ * benchmarked on a normal machine; see the end of `inflater.cpp`.
+ */
+
+
+/*
+ * The default size of the window of previous output we keep, which
+ * must be a power of two.  The output is passed to the handler in
+ * pieces of at most this size.
+ */
+#ifndef INFLATER_WINDOW
+#define INFLATER_WINDOW 4096
+#endif
+
+
+/*
+ * An output-handler is given the decompressed data in chunks.
+ */
+typedef std::function<void(const uint8_t *data, size_t len)> InflaterHandler;
+
+
+class Inflater
+{
+public:
+
+    /*
+     * The formats we understand.
+     *
+     * ZLIB streams which lack the zlib header are accepted as RAW,
+     * as some servers send them that way for `Content-Encoding: deflate`.
+     */
+    enum format_t { RAW, ZLIB, GZIP };
+
+    /*
+     * Constructor.
+     */
+    Inflater(size_t window = INFLATER_WINDOW);
+
+    /*
+     * Destructor.
+     */
+    ~Inflater();
+
+    /*
+     * Prepare to decompress a new stream of the given format.
+     *
+     * Returns false if we couldn't allocate our window.
+     */
+    bool begin(format_t format, InflaterHandler handler);
+
+    /*
+     * Decompress some more of the stream.
+     *
+     * Returns false if the stream is corrupt, or refers back further
+     * than our window.  Anything following the end of the stream is
+     * ignored.
+     */
+    bool write(const uint8_t *data, size_t len);
+
+    /*
+     * Have we decompressed the whole stream, and verified its checksum?
+     */
+    bool finished();
+
+    /*
+     * Did the decompression fail?
+     */
+    bool failed();
+
+    /*
+     * The number of bytes we've decompressed.
+     */
+    unsigned long total();
+
+
+private:
+
+    /*
+     * Where we are within the stream.
+     */
+    enum state_t
+    {
+        GZIP_HEADER, GZIP_EXTRA_LENGTH, GZIP_EXTRA, GZIP_NAME, GZIP_COMMENT, GZIP_HEADER_CRC,
+        ZLIB_HEADER,
+        BLOCK_HEADER,
+        STORED_LENGTH, STORED_DATA,
+        TABLE_SIZES, TABLE_CODES, TABLE_LENGTHS, TABLE_REPEAT,
+        LENGTH, LENGTH_EXTRA, DISTANCE, DISTANCE_EXTRA,
+        TRAILER,
+        DONE,
+        FAILED
+    };
+
+    /*
+     * A canonical Huffman code; the number of codes of each length,
+     * and the symbols they stand for, ordered by code.
+     */
+    struct huffman_t
+    {
+        uint16_t counts[16];
+        uint16_t *symbols;
+    };
+
+    /*
+     * Decompress as much of our input as we can.
+     */
+    void inflate();
+
+    /*
+     * Load whole bytes of input into our bit-buffer, and report
+     * whether we have at least `n` bits.
+     */
+    bool need(int n);
+
+    /*
+     * Remove `n` bits from our bit-buffer, and return them.
+     */
+    uint32_t bits(int n);
+
+    /*
+     * Decode a symbol using the given code.
+     *
+     * Returns -1 if we need more input, or -2 if the code is invalid.
+     */
+    int decode(huffman_t *code);
+
+    /*
+     * Build a code from the given code-lengths.
+     */
+    void build(huffman_t *code, const uint8_t *lengths, int count);
+
+    /*
+     * Append a byte to our output, and copy previous output.
+     */
+    void output(uint8_t c);
+    bool copy(uint32_t distance, uint32_t length);
+
+    /*
+     * Pass the output we haven't yet passed on to our handler.
+     */
+    void flush();
+
+
+    /*
+     * The format of our stream, and where we are within it.
+     */
+    format_t m_format = RAW;
+    state_t m_state = FAILED;
+
+    /*
+     * The handler for our output.
+     */
+    InflaterHandler m_handler;
+
+    /*
+     * The input we're currently processing.
+     */
+    const uint8_t *m_in = NULL;
+    const uint8_t *m_in_end = NULL;
+
+    /*
+     * Bits of input we've loaded but not used, least-significant first.
+     */
+    uint32_t m_bits = 0;
+    int m_nbits = 0;
+
+    /*
+     * The window of previous output, how much we've written in total,
+     * and how much of that has been passed to our handler.
+     */
+    uint8_t *m_window = NULL;
+    size_t m_window_size;
+    uint32_t m_pos = 0;
+    uint32_t m_flushed = 0;
+
+    /*
+     * The codes of the current block.
+     */
+    huffman_t m_lencode;
+    huffman_t m_distcode;
+    uint16_t m_lensym[288];
+    uint16_t m_distsym[30];
+
+    /*
+     * The code-lengths of a dynamic block, and how many of them
+     * there are.
+     */
+    uint8_t m_lengths[320];
+    int m_nlen = 0;
+    int m_ndist = 0;
+    int m_ncode = 0;
+
+    /*
+     * Counters, and lengths, used by the current state.
+     */
+    int m_count = 0;
+    int m_symbol = 0;
+    uint32_t m_length = 0;
+    uint32_t m_distance = 0;
+    int m_extra = 0;
+
+    /*
+     * Is the current block the last one?
+     */
+    bool m_final = false;
+
+    /*
+     * The gzip header-flags.
+     */
+    int m_flags = 0;
+
+    /*
+     * The checksum of our output, and the trailer which holds the
+     * expected value.
+     */
+    uint32_t m_check = 0;
+    uint8_t m_trailer[8];
+
+};
+
+#endif /* INFLATER_H */
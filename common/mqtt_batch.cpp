@@ -0,0 +1,200 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// Our header.
+//
+#include "mqtt_batch.h"
+
+
+/*
+ * The longest ending we might append to a batch: the close of the
+ * samples, and the age.
+ */
+#define MQTT_BATCH_TAIL sizeof("],\"age\":4294967295}")
+
+
+/*
+ * Constructor.
+ */
+MqttBatch::MqttBatch(const char *topic, MqttBatchSink sink)
+{
+    m_topic = topic;
+    m_sink = sink;
+    m_max_count = MQTT_BATCH_COUNT;
+    m_max_bytes = MQTT_BATCH_SIZE;
+    m_max_age = MQTT_BATCH_AGE;
+    m_count = 0;
+
+    setHeader("");
+}
+
+
+/*
+ * Set the members which begin each message.
+ */
+bool MqttBatch::setHeader(const char *header)
+{
+    if (m_count > 0)
+        return false;
+
+    int len = snprintf(m_buffer, sizeof(m_buffer), "{%s%s\"samples\":[",
+                       header, header[0] ? "," : "");
+
+    //
+    // The header must leave room for at least one reading.
+    //
+    if (len < 0 || len + MQTT_BATCH_TAIL + 16 > sizeof(m_buffer))
+    {
+        Serial.println("BUG - MqttBatch::setHeader - header too long");
+        len = snprintf(m_buffer, sizeof(m_buffer), "{\"samples\":[");
+    }
+
+    m_header = len;
+    reset();
+    return true;
+}
+
+
+/*
+ * Change our limits.  The size can't grow beyond our buffer.
+ */
+void MqttBatch::setLimits(uint8_t count, size_t bytes, unsigned long age)
+{
+    m_max_count = count ? count : 1;
+    m_max_bytes = (bytes < sizeof(m_buffer)) ? bytes : sizeof(m_buffer);
+    m_max_age = age;
+}
+
+
+/*
+ * Add a reading with one value.
+ */
+bool MqttBatch::add(long value)
+{
+    return add(&value, 1);
+}
+
+
+/*
+ * Add a reading with two values.
+ */
+bool MqttBatch::add(long value1, long value2)
+{
+    long values[2] = { value1, value2 };
+    return add(values, 2);
+}
+
+
+/*
+ * Add a reading, publishing the batch first if it won't fit, and after
+ * if it is then complete.
+ */
+bool MqttBatch::add(const long *values, uint8_t count)
+{
+    //
+    // A full batch we couldn't send earlier must go first, and if it
+    // still can't we refuse this reading rather than let it grow.
+    //
+    if (m_count >= m_max_count && !flush())
+        return false;
+
+    unsigned long now = millis();
+
+    if (count > MQTT_BATCH_VALUES)
+        count = MQTT_BATCH_VALUES;
+
+    //
+    // Format the sample on its own first, to see if it fits.
+    //
+    char sample[16 + MQTT_BATCH_VALUES * 12];
+    size_t len = snprintf(sample, sizeof(sample), "%s[%lu",
+                          m_count ? "," : "", m_count ? now - m_first : 0UL);
+
+    for (uint8_t i = 0; i < count; i++)
+        len += snprintf(sample + len, sizeof(sample) - len, ",%ld", values[i]);
+
+    sample[len++] = ']';
+    sample[len] = '\0';
+
+    if (m_used + len + MQTT_BATCH_TAIL > m_max_bytes)
+    {
+        //
+        // If it won't fit in an empty batch it never will.
+        //
+        if (m_count == 0 || !flush())
+            return false;
+
+        return add(values, count);
+    }
+
+    if (m_count == 0)
+        m_first = now;
+
+    memcpy(m_buffer + m_used, sample, len + 1);
+    m_used += len;
+    m_count += 1;
+
+    if (m_count >= m_max_count)
+        flush();
+
+    return true;
+}
+
+
+/*
+ * Publish the batch if it has grown old.
+ */
+void MqttBatch::loop()
+{
+    if (m_count > 0 && millis() - m_first >= m_max_age)
+        flush();
+}
+
+
+/*
+ * Publish the batch.  If that fails we keep it, and try again later.
+ */
+bool MqttBatch::flush()
+{
+    if (m_count == 0)
+        return true;
+
+    snprintf(m_buffer + m_used, sizeof(m_buffer) - m_used, "],\"age\":%lu}",
+             millis() - m_first);
+
+    bool sent = m_sink(m_topic, m_buffer);
+
+    //
+    // Remove the ending, so we can carry on.
+    //
+    m_buffer[m_used] = '\0';
+
+    if (sent)
+        reset();
+
+    return sent;
+}
+
+
+/*
+ * The readings waiting.
+ */
+uint8_t MqttBatch::count()
+{
+    return m_count;
+}
+
+
+/*
+ * Start a new batch, keeping the header.
+ */
+void MqttBatch::reset()
+{
+    m_used = m_header;
+    m_buffer[m_used] = '\0';
+    m_count = 0;
+    m_first = 0;
+}
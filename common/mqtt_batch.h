@@ -0,0 +1,164 @@
+#ifndef MQTT_BATCH_H
+#define MQTT_BATCH_H
+
+#include <Arduino.h>
+#include <functional>
+
+/*
+ * Collects timestamped readings for a topic, and publishes them as a
+ * single message, rather than one message per reading.
+ *
+ * Usage is as simple as:
+ *
+ *   MqttBatch batch("water", [](const char *topic, const char *payload)
+ *   {
+ *       return client.publish(topic, payload);
+ *   });
+ *
+ *   batch.setHeader("\"mac\":\"5C:CF:7F:01:02:03\"");
+ *
+ *   void loop()
+ *   {
+ *       batch.loop();
+ *       ..
+ *       batch.add(flow);
+ *   }
+ *
+ * A batch is published once it holds MQTT_BATCH_COUNT readings, once
+ * the next reading wouldn't fit in MQTT_BATCH_SIZE bytes, or once the
+ * oldest reading is MQTT_BATCH_AGE milliseconds old, whichever comes
+ * first.  The message looks like this:
+ *
+ *   {"mac":"5C:CF:7F:01:02:03","samples":[[0,12],[5000,14]],"age":5003}
+ *
+ * Each sample holds the time it was taken, in milliseconds after the
+ * first, followed by its values.  "age" is how long before publishing
+ * the first was taken, so a reading was taken at the time the message
+ * arrived, less "age", plus its own offset.
+ */
+
+
+/*
+ * The largest message we'll build, including the header.  This must fit,
+ * with the topic, in the PubSubClient's buffer - see setBufferSize() -
+ * and in an MqttQueue record if that is where the batch goes, so
+ * setLimits() can lower it for a particular batch.
+ */
+#ifndef MQTT_BATCH_SIZE
+#define MQTT_BATCH_SIZE 256
+#endif
+
+/*
+ * The default number of readings in a batch, and the default age at
+ * which a batch is published regardless, in milliseconds.
+ */
+#ifndef MQTT_BATCH_COUNT
+#define MQTT_BATCH_COUNT 10
+#endif
+
+#ifndef MQTT_BATCH_AGE
+#define MQTT_BATCH_AGE 60000
+#endif
+
+/*
+ * The most values a single reading may have.
+ */
+#ifndef MQTT_BATCH_VALUES
+#define MQTT_BATCH_VALUES 4
+#endif
+
+
+/*
+ * Where a finished batch is sent - typically PubSubClient::publish(),
+ * or MqttQueue::publish().  Returns false if it couldn't be sent, and
+ * we'll try again later.
+ */
+typedef std::function<bool(const char *topic, const char *payload)> MqttBatchSink;
+
+
+class MqttBatch
+{
+public:
+
+    /*
+     * Constructor.  The topic must remain valid for our lifetime.
+     */
+    MqttBatch(const char *topic, MqttBatchSink sink);
+
+    /*
+     * Set JSON members to begin each message with, without the braces.
+     * This can only be changed while the batch is empty.
+     */
+    bool setHeader(const char *header);
+
+    /*
+     * Change the limits on the number of readings in a batch, the size
+     * of the message, and the age of the oldest reading.
+     */
+    void setLimits(uint8_t count, size_t bytes, unsigned long age);
+
+    /*
+     * Add a reading, taken now.
+     *
+     * Returns false if the reading couldn't be added, because the batch
+     * is full and couldn't be sent.  The reading is then dropped, and
+     * the batch is kept as it is, to be sent by a later call.
+     */
+    bool add(long value);
+    bool add(long value1, long value2);
+    bool add(const long *values, uint8_t count);
+
+    /*
+     * Publish the batch if its oldest reading has grown too old.  Call
+     * this from your sketch's loop().
+     */
+    void loop();
+
+    /*
+     * Publish the batch now, if it isn't empty.
+     */
+    bool flush();
+
+    /*
+     * The number of readings waiting in the batch.
+     */
+    uint8_t count();
+
+
+private:
+
+    /*
+     * Start a new batch.
+     */
+    void reset();
+
+    /*
+     * The topic we publish to, and how.
+     */
+    const char *m_topic;
+    MqttBatchSink m_sink;
+
+    /*
+     * The message we're building, and how much of it is used.  The
+     * header is always the first m_header bytes.
+     */
+    char m_buffer[MQTT_BATCH_SIZE];
+    size_t m_used;
+    size_t m_header;
+
+    /*
+     * The readings in the batch, and when the first was taken.
+     */
+    uint8_t m_count;
+    unsigned long m_first;
+
+    /*
+     * Our limits.
+     */
+    uint8_t m_max_count;
+    size_t m_max_bytes;
+    unsigned long m_max_age;
+
+};
+
+#endif /* MQTT_BATCH_H */
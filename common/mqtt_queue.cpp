@@ -0,0 +1,338 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// For the log.
+//
+#include <FS.h>
+
+//
+// Our header.
+//
+#include "mqtt_queue.h"
+
+
+/*
+ * The CRC-32 of each nibble.
+ */
+static const uint32_t crc_table[16] =
+{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+
+/*
+ * Continue the CRC-32 of a buffer.
+ */
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+
+    while (len--)
+    {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc_table[crc & 15];
+        crc = (crc >> 4) ^ crc_table[crc & 15];
+    }
+
+    return crc;
+}
+
+
+/*
+ * Constructor.
+ */
+MqttQueue::MqttQueue(PubSubClient &client) : m_client(client)
+{
+    m_head = 1;
+    m_tail = 1;
+    m_saved = 1;
+    m_last_sent = 0;
+    m_interval = MQTT_QUEUE_INTERVAL;
+    m_dropped = 0;
+}
+
+
+/*
+ * Open the log, and find what we haven't sent.
+ */
+bool MqttQueue::begin()
+{
+    static_assert(sizeof(Record) == MQTT_QUEUE_RECORD_SIZE, "MQTT_QUEUE_RECORD_SIZE must be a multiple of four");
+
+    //
+    // A new log is filled with empty records, so that we only ever
+    // overwrite it in place.
+    //
+    if (!SPIFFS.exists(MQTT_QUEUE_PATH))
+    {
+        File f = SPIFFS.open(MQTT_QUEUE_PATH, "w");
+
+        if (!f)
+            return false;
+
+        Record empty;
+        memset(&empty, 0, sizeof(empty));
+
+        for (int i = 0; i < MQTT_QUEUE_RECORDS; i++)
+        {
+            if (f.write((const uint8_t *)&empty, sizeof(empty)) != sizeof(empty))
+                return false;
+        }
+
+        f.close();
+    }
+
+    //
+    // The newest intact record follows the last message we appended, and
+    // the oldest is the first we might not have sent.
+    //
+    uint32_t newest = 0;
+    uint32_t oldest = 0;
+    Record record;
+
+    for (uint32_t slot = 0; slot < MQTT_QUEUE_RECORDS; slot++)
+    {
+        if (!read_record(slot, record))
+            continue;
+
+        if (record.seq > newest)
+            newest = record.seq;
+
+        if (oldest == 0 || record.seq < oldest)
+            oldest = record.seq;
+    }
+
+    uint32_t sent = 0;
+    File f = SPIFFS.open(MQTT_QUEUE_SENT_PATH, "r");
+
+    if (f)
+    {
+        uint32_t saved[2];
+
+        if (f.read((uint8_t *)saved, sizeof(saved)) == sizeof(saved) &&
+                crc32(0xffffffff, &saved[0], sizeof(saved[0])) == saved[1])
+            sent = saved[0];
+
+        f.close();
+    }
+
+    m_head = newest + 1;
+
+    if (sent > m_head)
+        m_head = sent;
+
+    if (sent != 0)
+        m_tail = sent;
+    else if (oldest != 0)
+        m_tail = oldest;
+    else
+        m_tail = m_head;
+
+    if (m_head - m_tail > MQTT_QUEUE_RECORDS)
+        m_tail = m_head - MQTT_QUEUE_RECORDS;
+
+    m_saved = m_tail;
+    return true;
+}
+
+
+/*
+ * Publish a message, or append it to the log.
+ */
+bool MqttQueue::publish(const char *topic, const char *payload)
+{
+    //
+    // With nothing waiting there's no ordering to preserve, so we can
+    // send straight away.
+    //
+    if (m_tail == m_head && m_client.connected() &&
+            m_client.publish(topic, payload, false, 1))
+        return true;
+
+    return append(topic, payload);
+}
+
+
+/*
+ * Append a message to the log, overwriting the oldest if it is full.
+ */
+bool MqttQueue::append(const char *topic, const char *payload)
+{
+    size_t topic_len = strlen(topic);
+    size_t payload_len = strlen(payload);
+    Record record;
+
+    if (topic_len + payload_len > sizeof(record.data))
+        return false;
+
+    memset(&record, 0, sizeof(record));
+    record.seq = m_head;
+    record.topic_len = topic_len;
+    record.payload_len = payload_len;
+    memcpy(record.data, topic, topic_len);
+    memcpy(record.data + topic_len, payload, payload_len);
+    record.crc = record_crc(record);
+
+    File f = SPIFFS.open(MQTT_QUEUE_PATH, "r+");
+
+    if (!f)
+        return false;
+
+    f.seek((m_head % MQTT_QUEUE_RECORDS) * sizeof(record), SeekSet);
+
+    if (f.write((const uint8_t *)&record, sizeof(record)) != sizeof(record))
+        return false;
+
+    f.close();
+
+    m_head += 1;
+
+    if (m_head - m_tail > MQTT_QUEUE_RECORDS)
+    {
+        m_tail += 1;
+        m_dropped += 1;
+    }
+
+    return true;
+}
+
+
+/*
+ * Send the next message from the log.
+ */
+void MqttQueue::loop()
+{
+    if (!m_client.connected())
+        return;
+
+    unsigned long now = millis();
+
+    if (m_tail != m_head && now - m_last_sent >= m_interval)
+    {
+        Record record;
+
+        if (!read_record(m_tail % MQTT_QUEUE_RECORDS, record) || record.seq != m_tail)
+        {
+            //
+            // Torn by a reset while we were writing it.
+            //
+            m_tail += 1;
+            m_dropped += 1;
+        }
+        else
+        {
+            char topic[sizeof(record.data) + 1];
+            char payload[sizeof(record.data) + 1];
+
+            memcpy(topic, record.data, record.topic_len);
+            topic[record.topic_len] = '\0';
+            memcpy(payload, record.data + record.topic_len, record.payload_len);
+            payload[record.payload_len] = '\0';
+
+            //
+            // If the in-flight window is full we try again next time.
+            //
+            if (m_client.publish(topic, payload, false, 1))
+            {
+                m_tail += 1;
+                m_last_sent = now;
+            }
+        }
+    }
+
+    //
+    // Only once the broker has acknowledged everything do we know that
+    // what we've sent has arrived.
+    //
+    if (m_saved != m_tail && m_client.inflight() == 0 &&
+            (m_tail == m_head || m_tail - m_saved >= MQTT_QUEUE_SYNC))
+        save_sent();
+}
+
+
+/*
+ * Read a record, and check it is intact.
+ */
+bool MqttQueue::read_record(uint32_t slot, Record &record)
+{
+    File f = SPIFFS.open(MQTT_QUEUE_PATH, "r");
+
+    if (!f)
+        return false;
+
+    f.seek(slot * sizeof(record), SeekSet);
+
+    if (f.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
+        return false;
+
+    if (record.seq == 0 ||
+            record.topic_len + record.payload_len > sizeof(record.data))
+        return false;
+
+    return (record.crc == record_crc(record));
+}
+
+
+/*
+ * Record the next message we'd send after a reboot.
+ */
+void MqttQueue::save_sent()
+{
+    uint32_t saved[2];
+
+    saved[0] = m_tail;
+    saved[1] = crc32(0xffffffff, &saved[0], sizeof(saved[0]));
+
+    File f = SPIFFS.open(MQTT_QUEUE_SENT_PATH, "w");
+
+    if (f)
+    {
+        f.write((const uint8_t *)saved, sizeof(saved));
+        f.close();
+        m_saved = m_tail;
+    }
+}
+
+
+/*
+ * The CRC-32 of a record, excluding the CRC itself.
+ */
+uint32_t MqttQueue::record_crc(const Record &record)
+{
+    uint32_t crc = crc32(0xffffffff, &record.seq, sizeof(record.seq));
+    crc = crc32(crc, &record.topic_len, 4 + record.topic_len + record.payload_len);
+    return ~crc;
+}
+
+
+/*
+ * Set the minimum time between messages sent from the log.
+ */
+void MqttQueue::setInterval(unsigned long ms)
+{
+    m_interval = ms;
+}
+
+
+/*
+ * The messages waiting to be sent.
+ */
+unsigned long MqttQueue::pending()
+{
+    return m_head - m_tail;
+}
+
+
+/*
+ * The messages we've lost.
+ */
+unsigned long MqttQueue::dropped()
+{
+    return m_dropped;
+}
@@ -0,0 +1,199 @@
+#ifndef MQTT_QUEUE_H
+#define MQTT_QUEUE_H
+
+#include "PubSubClient.h"
+
+/*
+ * A store-and-forward queue for PubSubClient, which keeps the messages
+ * we couldn't send in a ring-log in SPIFFS, so that they survive both
+ * the broker going away and the device rebooting.
+ *
+ * Usage is as simple as:
+ *
+ *   MqttQueue queue(client);
+ *
+ *   void setup()
+ *   {
+ *       SPIFFS.begin();
+ *       queue.begin();
+ *   }
+ *
+ *   void loop()
+ *   {
+ *       queue.loop();
+ *       ..
+ *       queue.publish( "water", payload.c_str() );
+ *   }
+ *
+ * While we're connected, and nothing is waiting, messages are published
+ * immediately at QoS 1.  Otherwise they're appended to the log, and once
+ * we're connected again loop() sends them in order, one every
+ * MQTT_QUEUE_INTERVAL milliseconds, so that a long backlog doesn't swamp
+ * the broker, or starve the rest of the sketch.
+ *
+ * The log has a fixed number of records, each holding a sequence number
+ * and a CRC-32; when it is full the oldest record is overwritten.  We
+ * remember how far we've sent in a second file, which is only updated
+ * once the broker has acknowledged everything, so after a reboot a few
+ * queued messages may be sent twice, but none of them are lost.
+ *
+ * A message published immediately never reaches the log, so as not to
+ * wear the flash; until the broker acknowledges it, it is held only in
+ * PubSubClient's in-flight window, and is lost if we reboot meanwhile.
+ */
+
+
+/*
+ * The number of records in the log, and the size of each.  A record
+ * holds the topic and the payload of one message, after a twelve byte
+ * header.
+ */
+#ifndef MQTT_QUEUE_RECORDS
+#define MQTT_QUEUE_RECORDS 32
+#endif
+
+#ifndef MQTT_QUEUE_RECORD_SIZE
+#define MQTT_QUEUE_RECORD_SIZE 128
+#endif
+
+/*
+ * The minimum time between the messages we send from the log, in
+ * milliseconds.
+ */
+#ifndef MQTT_QUEUE_INTERVAL
+#define MQTT_QUEUE_INTERVAL 250
+#endif
+
+/*
+ * How many messages we'll send from the log before recording our
+ * progress, to limit the wear on the flash.
+ */
+#ifndef MQTT_QUEUE_SYNC
+#define MQTT_QUEUE_SYNC 8
+#endif
+
+/*
+ * The files we use.
+ */
+#ifndef MQTT_QUEUE_PATH
+#define MQTT_QUEUE_PATH "/mqtt-queue.log"
+#endif
+
+#ifndef MQTT_QUEUE_SENT_PATH
+#define MQTT_QUEUE_SENT_PATH "/mqtt-queue.sent"
+#endif
+
+
+class MqttQueue
+{
+public:
+
+    /*
+     * Constructor.  The client should already have its server set.
+     */
+    MqttQueue(PubSubClient &client);
+
+    /*
+     * Open the log, creating it if need be, and find the messages we
+     * haven't sent.  SPIFFS must already have been started.
+     *
+     * Returns false if the log couldn't be created.
+     */
+    bool begin();
+
+    /*
+     * Publish a message, or queue it if we can't.
+     *
+     * Returns false if the message is too large for a record, or it
+     * couldn't be written to the log.
+     */
+    bool publish(const char *topic, const char *payload);
+
+    /*
+     * Send the next queued message, if we're connected and it is time.
+     * Call this from your sketch's loop().
+     */
+    void loop();
+
+    /*
+     * Set the minimum time between messages sent from the log, in
+     * milliseconds.
+     */
+    void setInterval(unsigned long ms);
+
+    /*
+     * The number of messages waiting in the log.
+     */
+    unsigned long pending();
+
+    /*
+     * The number of messages we've lost: overwritten before they could
+     * be sent, or found to be corrupt.
+     */
+    unsigned long dropped();
+
+
+private:
+
+    /*
+     * A record in the log.  The CRC covers the sequence number, the
+     * lengths, and the data - the topic, followed by the payload.
+     */
+    struct Record
+    {
+        uint32_t seq;
+        uint32_t crc;
+        uint16_t topic_len;
+        uint16_t payload_len;
+        char data[MQTT_QUEUE_RECORD_SIZE - 12];
+    };
+
+    /*
+     * Append a message to the log.
+     */
+    bool append(const char *topic, const char *payload);
+
+    /*
+     * Read the record with the given slot, returning true if it is
+     * intact.
+     */
+    bool read_record(uint32_t slot, Record &record);
+
+    /*
+     * Record how far we've sent.
+     */
+    void save_sent();
+
+    /*
+     * The CRC-32 of a record.
+     */
+    static uint32_t record_crc(const Record &record);
+
+    /*
+     * The client we publish with.
+     */
+    PubSubClient &m_client;
+
+    /*
+     * The sequence number of the next message we'll append, the next we
+     * will send, and the next we'd send after a reboot.  Zero is never
+     * used, so that an empty record is never valid.
+     */
+    uint32_t m_head;
+    uint32_t m_tail;
+    uint32_t m_saved;
+
+    /*
+     * When we last sent a message from the log, and how often we may.
+     */
+    unsigned long m_last_sent;
+    unsigned long m_interval;
+
+    /*
+     * The messages we've lost.
+     */
+    unsigned long m_dropped;
+
+};
+
+#endif /* MQTT_QUEUE_H */
@@ -14,6 +14,36 @@
 // Our header.
 //
 #include "url_fetcher.h"
+#include "dns_cache.h"
+
+
+/*
+ * Idle connections, kept open for reuse.
+ */
+UrlFetcher::PooledConnection UrlFetcher::s_pool[URL_FETCHER_POOL_SIZE];
+
+
+/*
+ * TLS sessions, kept for resumption.
+ */
+UrlFetcher::CachedSession UrlFetcher::s_sessions[URL_FETCHER_SESSIONS];
+unsigned long UrlFetcher::s_session_hits = 0;
+unsigned long UrlFetcher::s_session_misses = 0;
+
+
+/*
+ * Timing statistics, per host.
+ */
+UrlFetcherHostStats UrlFetcher::s_stats[URL_FETCHER_STATS_HOSTS];
+
+
+/*
+ * Cached responses.
+ */
+UrlFetcher::CachedResponse UrlFetcher::s_cache[URL_FETCHER_CACHE_ENTRIES];
+unsigned long UrlFetcher::s_cache_hits = 0;
+unsigned long UrlFetcher::s_cache_revalidations = 0;
+unsigned long UrlFetcher::s_cache_misses = 0;
 
 
 /*
@@ -37,10 +67,10 @@ UrlFetcher::~UrlFetcher()
         m_url = NULL;
     }
 
-    if (m_status)
+    if (m_header_buf)
     {
-        free(m_status);
-        m_status = NULL;
+        free(m_header_buf);
+        m_header_buf = NULL;
     }
 
     if (m_user_agent)
@@ -49,11 +79,19 @@ UrlFetcher::~UrlFetcher()
         m_user_agent = NULL;
     }
 
-    if (m_client)
+    if (m_copy)
     {
-        delete(m_client);
-        m_client = NULL;
+        free(m_copy);
+        m_copy = NULL;
+    }
+
+    if (m_inflater)
+    {
+        delete(m_inflater);
+        m_inflater = NULL;
     }
+
+    release(false);
 }
 
 /*
@@ -102,6 +140,9 @@ char *UrlFetcher::getPath()
  */
 int UrlFetcher::port()
 {
+    if (m_port > 0)
+        return m_port;
+
     if (is_secure())
         return 443;
     else
@@ -149,6 +190,118 @@ void UrlFetcher::setAgent(const char *userAgent)
     m_user_agent = strdup(userAgent);
 }
 
+/*
+ * Enable/Disable HTTP/1.1 keep-alive connections.
+ */
+void UrlFetcher::setKeepAlive(bool enabled)
+{
+    m_keep_alive = enabled;
+}
+
+/*
+ * Close pooled connections which have expired, or all of them.
+ */
+void UrlFetcher::closeIdle(bool all)
+{
+    unsigned long now = millis();
+
+    for (int i = 0; i < URL_FETCHER_POOL_SIZE; i++)
+    {
+        PooledConnection *p = &s_pool[i];
+
+        if (p->client == NULL)
+            continue;
+
+        if (all || (now - p->last_used > URL_FETCHER_POOL_IDLE) || ! p->client->connected())
+        {
+            p->client->stop();
+            delete(p->client);
+            p->client = NULL;
+        }
+    }
+}
+
+/*
+ * The number of secure connections which offered a cached TLS session.
+ */
+unsigned long UrlFetcher::sessionHits()
+{
+    return s_session_hits;
+}
+
+/*
+ * The number of secure connections which made a full TLS handshake.
+ */
+unsigned long UrlFetcher::sessionMisses()
+{
+    return s_session_misses;
+}
+
+/*
+ * Enable/Disable the negotiation of small TLS buffers.
+ */
+void UrlFetcher::setSmallTLSBuffers(bool enabled)
+{
+    m_small_tls = enabled;
+}
+
+/*
+ * The size of our TLS receive-buffer, or zero if we're not secure.
+ */
+int UrlFetcher::tlsReceiveBuffer()
+{
+    return m_tls_rx;
+}
+
+/*
+ * The size of our TLS send-buffer, or zero if we're not secure.
+ */
+int UrlFetcher::tlsSendBuffer()
+{
+    return m_tls_tx;
+}
+
+/*
+ * Enable/Disable the caching of our response.
+ */
+void UrlFetcher::setCaching(bool enabled)
+{
+    m_caching = enabled;
+}
+
+/*
+ * Enable/Disable compressed responses.
+ */
+void UrlFetcher::setCompression(bool enabled, size_t window)
+{
+    m_compression = enabled;
+    m_window = window;
+}
+
+/*
+ * The number of fetches served from the cache.
+ */
+unsigned long UrlFetcher::cacheHits()
+{
+    return s_cache_hits;
+}
+
+/*
+ * The number of fetches revalidated with a `304 Not Modified`.
+ */
+unsigned long UrlFetcher::cacheRevalidations()
+{
+    return s_cache_revalidations;
+}
+
+/*
+ * The number of fetches which downloaded their response.
+ */
+unsigned long UrlFetcher::cacheMisses()
+{
+    return s_cache_misses;
+}
+
 /*
  * Return the body-contents of the remote URL.
  *
@@ -166,6 +319,22 @@ String UrlFetcher::body()
 }
 
 
+/*
+ * Fetch the remote URL, passing the body to the given handler
+ * as it arrives rather than storing it.
+ */
+int UrlFetcher::stream(UrlFetcherBodyHandler handler)
+{
+    if (! m_fetched)
+    {
+        fetch(handler);
+        m_fetched = true;
+    }
+
+    return (code());
+}
+
+
 /*
  * Return the headers of the remote URL.
  *
@@ -185,6 +354,8 @@ String UrlFetcher::headers()
 
 /*
  * Return the HTTP-status-code of our fetch.
+ *
+ * This is parsed once, when the headers have been received.
  */
 int UrlFetcher::code()
 {
@@ -197,6 +368,86 @@ int UrlFetcher::code()
         m_fetched = true;
     }
 
+    return (m_code);
+}
+
+
+/*
+ * Did we receive the complete response?
+ */
+bool UrlFetcher::complete()
+{
+    if (! m_fetched)
+    {
+        fetch();
+        m_fetched = true;
+    }
+
+    return (m_complete);
+}
+
+
+/*
+ * Set the time we'll wait for a fetch to complete.
+ */
+void UrlFetcher::setTimeout(unsigned long ms)
+{
+    m_timeout = ms;
+}
+
+
+/*
+ * Set how many attempts we'll make, and the delays between them.
+ */
+void UrlFetcher::setRetries(int attempts, unsigned long backoff, unsigned long backoff_max)
+{
+    m_attempts = attempts < 1 ? 1 : attempts;
+    m_backoff = backoff;
+    m_backoff_max = backoff_max;
+}
+
+
+/*
+ * Set the status-codes which are worth retrying.
+ */
+void UrlFetcher::setRetryCodes(const int *codes, int count)
+{
+    if (count > URL_FETCHER_RETRY_CODES)
+    {
+        Serial.println("BUG - UrlFetcher::setRetryCodes - too many codes");
+        count = URL_FETCHER_RETRY_CODES;
+    }
+
+    for (int i = 0; i < count; i++)
+        m_retry_codes[i] = codes[i];
+
+    m_retry_count = count;
+}
+
+
+/*
+ * Set the deadline for all of our attempts.
+ */
+void UrlFetcher::setDeadline(unsigned long ms)
+{
+    m_deadline = ms;
+}
+
+
+/*
+ * The number of attempts our last fetch made.
+ */
+int UrlFetcher::attempts()
+{
+    return (m_attempt);
+}
+
+
+/*
+ * Parse the HTTP-status-code from the status-line of our headers.
+ */
+int UrlFetcher::parse_code()
+{
     //
     // If we failed to do the fetch then we're bogus
     //
@@ -281,173 +532,1782 @@ int UrlFetcher::code()
 }
 
 /*
- * Return the complete status-line of the remote server
+ * Return the complete status-line of the remote server.
+ *
+ * This is the first line of our indexed headers, so no copy is made.
  */
 char *UrlFetcher::status()
 {
-    if (m_status == NULL)
-    {
-        //
-        // Ensure that `m_headers` is populated.
-        //
-        if (! m_fetched)
-        {
-            fetch();
-            m_fetched = true;
-        }
+    static char failed[] = "HTTP/1.0 -1 FAILED-FETCH";
 
-        //
-        // If we failed to do the fetch then we're bogus
-        //
-        if (m_headers.length() == 0)
-        {
-            m_status = strdup("HTTP/1.0 -1 FAILED-FETCH");
-            return (m_status);
-        }
-
-        //
-        // Get the response-headers, which will have the
-        // status-line in the first .. line.
-        //
-        const char *response = m_headers.c_str();
+    //
+    // Ensure that `m_headers` is populated.
+    //
+    if (! m_fetched)
+    {
+        fetch();
+        m_fetched = true;
+    }
 
-        if (response == NULL)
-        {
-            return NULL;
-        }
+    //
+    // If we failed to do the fetch then we're bogus
+    //
+    if (m_status == NULL)
+        return (failed);
 
-        //
-        // Find the first newline.
-        //
-        char *end = strchr(response, '\n');
+    return (m_status);
+}
 
-        //
-        // Allocate memory for a copy of that first line.
-        //
-        m_status = (char *)malloc(end - response + 1);
-        memset(m_status, '\0', end - response + 1);
 
-        //
-        // Copy it into place.
-        //
-        strncpy(m_status, response, end - response);
+/*
+ * Return the value of the named response-header, ignoring case.
+ */
+const char *UrlFetcher::header(const char *name)
+{
+    if (! m_fetched)
+    {
+        fetch();
+        m_fetched = true;
     }
 
-    // Return our copied memory.
-    return (m_status);
+    return (find_header(name));
 }
 
+
 /*
- * Fetch the contents of the remote URL.
+ * A case-insensitive hash of a header-name.
  */
-void UrlFetcher::fetch()
+static uint16_t header_hash(const char *name)
 {
+    uint16_t hash = 5381;
 
-    /*
-     * Remove any old state, if present.
-     */
-    m_headers = "";
-    m_body = "";
+    while (*name)
+        hash = (hash * 33) ^ tolower(*name++);
 
-    /*
-     * If we've not already parsed into Host + Path, do so.
-     */
-    if (strlen(m_host) < 1)
-        parse();
+    return (hash);
+}
 
 
-    /*
-     * Still empty?  That's a bug
-     */
-    if (strlen(m_host) < 1)
+/*
+ * Build the index of our headers.
+ *
+ * We take a copy of them in which each line, and the name of each
+ * header, is terminated.  The index is a small open-addressed hash
+ * table, holding the offsets of each name and value within that copy.
+ */
+void UrlFetcher::index_headers()
+{
+    if (m_header_buf)
     {
-        Serial.println("BUG - UrlFetcher::fetch - empty host");
-        return;
+        free(m_header_buf);
+        m_header_buf = NULL;
     }
 
-    /*
-     * Create the appropriate client-object.
-     */
-    if (is_secure())
-        m_client = new WiFiClientSecure();
-    else
-        m_client = new WiFiClient;
+    memset(m_index, 0, sizeof(m_index));
+    m_status = NULL;
+    m_code = parse_code();
+
+    size_t len = m_headers.length();
+
+    if (len == 0 || len >= 65535)
+        return;
 
+    m_header_buf = (char *)malloc(len + 1);
 
-    bool finishedHeaders = false;
-    bool currentLineIsBlank = true;
-    long now;
+    if (m_header_buf == NULL)
+        return;
+
+    memcpy(m_header_buf, m_headers.c_str(), len);
+    m_header_buf[len] = '\0';
 
-    if (m_client->connect(m_host, port()))
+    char *line = m_header_buf;
+
+    while (line != NULL && *line != '\0')
     {
-        m_client->print("GET ");
-        m_client->print(m_path);
-        m_client->println(" HTTP/1.0");
-        m_client->print("Host: ");
-        m_client->println(m_host);
-        m_client->print("User-Agent: ");
-        m_client->println(getAgent());
-        m_client->println("Connection: close");
-        m_client->println("");
+        char *next = strchr(line, '\n');
+
+        if (next != NULL)
+            *next++ = '\0';
 
-        now = millis();
+        char *end = line + strlen(line);
+
+        while (end > line && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+            *--end = '\0';
 
         //
-        // Test for timeout waiting for the first byte.
+        // The first line is the status-line, the rest are headers.
         //
-        while (m_client->available() == 0)
+        char *colon = strchr(line, ':');
+
+        if (m_status == NULL)
         {
-            if (millis() - now > 15000)
-            {
-                Serial.println(">>> Client Timeout !");
-                m_client->stop();
-                return;
-            }
+            m_status = line;
         }
-
-        //
-        // Now we hope we'll have smooth-sailing, and we'll
-        // read a single character until we've got it all
-        //
-        while (m_client->available())
+        else if (colon != NULL)
         {
-            char c = m_client->read();
+            *colon = '\0';
 
-            if (finishedHeaders)
-            {
-                m_body = m_body + c;
-            }
-            else
-            {
-                if (currentLineIsBlank && c == '\n')
-                    finishedHeaders = true;
-                else
-                    m_headers = m_headers + c;
-            }
+            char *value = colon + 1;
 
-            if (c == '\n')
-                currentLineIsBlank = true;
-            else if (c != '\r')
-                currentLineIsBlank = false;
+            while (*value == ' ' || *value == '\t')
+                value += 1;
+
+            uint16_t hash = header_hash(line);
 
-            // Wait for more packetses
-            delay(1);
+            //
+            // Find a free slot; if the header is repeated we keep the
+            // first, and if we're full the rest are ignored.
+            //
+            for (int i = 0; i < URL_FETCHER_HEADERS; i++)
+            {
+                HeaderIndex *h = &m_index[(hash + i) & (URL_FETCHER_HEADERS - 1)];
+
+                if (h->name == 0)
+                {
+                    h->hash   = hash;
+                    h->name   = line - m_header_buf;
+                    h->value  = value - m_header_buf;
+                    h->length = end - value;
+                    break;
+                }
+
+                if (h->hash == hash && strcasecmp(m_header_buf + h->name, line) == 0)
+                    break;
+            }
         }
 
-        m_client->stop();
+        line = next;
     }
 }
 
 
 /*
- * Parse the URL into "host" + "path".
+ * Append `len` bytes of data to the given string.
+ *
+ * The String class doesn't let us append a buffer of a given length,
+ * so we copy it through a small NUL-terminated block.
  */
-void UrlFetcher::parse()
+static void append(String &str, const uint8_t *data, size_t len)
 {
-    /*
-     * Look for the host.
-     */
-    char *host_start = strstr(m_url, "://");
+    char tmp[65];
+
+    while (len > 0)
+    {
+        size_t n = len < sizeof(tmp) - 1 ? len : sizeof(tmp) - 1;
+
+        memcpy(tmp, data, n);
+        tmp[n] = '\0';
+        str += tmp;
+
+        data += n;
+        len  -= n;
+    }
+}
+
+
+/*
+ * Fetch the contents of the remote URL, storing the body.
+ */
+void UrlFetcher::fetch()
+{
+    fetch(nullptr);
+}
+
+
+/*
+ * Fetch the contents of the remote URL, passing the body to
+ * the given handler.
+ *
+ * This is an asynchronous fetch which we wait for.
+ */
+void UrlFetcher::fetch(UrlFetcherBodyHandler handler)
+{
+    begin(handler);
+
+    while (poll() != URL_FETCH_DONE)
+        delay(1);
+}
+
+
+/*
+ * Start fetching the remote URL in the background.
+ */
+void UrlFetcher::begin(UrlFetcherBodyHandler handler, UrlFetcherDoneHandler done)
+{
+    /*
+     * Abandon any fetch which is still running.
+     */
+    release(false);
+    m_download = false;
+
+    /*
+     * Remove any old state, if present.
+     */
+    reset();
+
+    /*
+     * Mark ourselves as fetched, so that the handler can call
+     * `code()` without triggering a second fetch.
+     */
+    m_fetched = true;
+
+    /*
+     * Without a handler we store the body.
+     */
+    if (handler)
+    {
+        m_handler = handler;
+    }
+    else
+    {
+        m_handler = [this](const uint8_t * data, size_t len)
+        {
+            store_body(data, len);
+        };
+    }
+
+    m_done = done;
+    m_begun = millis();
+    m_started = m_begun;
+    m_attempt = 1;
+    m_attempt_timeout = m_timeout;
+
+    if (m_deadline > 0 && m_deadline < m_timeout)
+        m_attempt_timeout = m_deadline;
+
+    m_state = URL_FETCH_CONNECTING;
+
+    /*
+     * If we've not already parsed into Host + Path, do so.
+     */
+    if (strlen(m_host) < 1)
+        parse();
+
+    /*
+     * Any cached response is found as each attempt starts, since other
+     * fetches may replace it in the meantime.
+     */
+    m_cached = NULL;
+    m_unconditional = false;
+}
+
+
+/*
+ * Download the remote URL into the named file, and wait for it.
+ */
+bool UrlFetcher::download(const char *path)
+{
+    beginDownload(path);
+
+    while (poll() != URL_FETCH_DONE)
+        delay(1);
+
+    return (m_downloaded);
+}
+
+
+/*
+ * Start downloading the remote URL into the named file.
+ */
+void UrlFetcher::beginDownload(const char *path, UrlFetcherDoneHandler done)
+{
+    begin([this](const uint8_t * data, size_t len)
+    {
+        write_download(data, len);
+    }, done);
+
+    m_download = true;
+    m_download_path = path;
+    m_cached = NULL;
+    m_cacheable = false;
+}
+
+
+/*
+ * Forget the response of a previous attempt.
+ */
+void UrlFetcher::reset()
+{
+    if (m_copy)
+    {
+        free(m_copy);
+        m_copy = NULL;
+        m_copy_size = 0;
+    }
+
+    if (m_inflater)
+    {
+        delete(m_inflater);
+        m_inflater = NULL;
+    }
+
+    m_headers = "";
+    m_body = "";
+    index_headers();
+    m_complete = false;
+    m_header_done = false;
+    m_line_blank = true;
+    m_reused = false;
+    m_received = 0;
+    m_reserved = 0;
+    m_first_byte = false;
+    m_cacheable = m_caching && ! m_download;
+    m_downloaded = false;
+    memset(&m_timings, 0, sizeof(m_timings));
+
+    if (m_file)
+        m_file.close();
+}
+
+
+/*
+ * Is the given status-code worth retrying?
+ */
+bool UrlFetcher::retryable(int code)
+{
+    for (int i = 0; i < m_retry_count; i++)
+    {
+        if (m_retry_codes[i] == code)
+            return true;
+    }
+
+    return false;
+}
+
+
+/*
+ * Abandon the current attempt, and arrange another.
+ *
+ * The delay doubles with each attempt, and we wait for a random time
+ * between half of it and all of it.  If the server told us how long
+ * to wait we'll wait at least that long.
+ */
+bool UrlFetcher::retry()
+{
+    //
+    // A download can resume from wherever it stopped, but other
+    // fetches can't take back what they've given to the handler.
+    //
+    if (m_attempt >= m_attempts || (m_received > 0 && ! m_download))
+        return false;
+
+    unsigned long delay = m_backoff;
+
+    for (int i = 1; i < m_attempt && delay < m_backoff_max; i++)
+        delay *= 2;
+
+    if (delay > m_backoff_max)
+        delay = m_backoff_max;
+
+    delay = random(delay / 2, delay + 1);
+
+    const char *after = find_header("retry-after");
+
+    if (after && isdigit(after[0]))
+    {
+        unsigned long wanted = strtoul(after, NULL, 10) * 1000;
+
+        if (wanted > delay)
+            delay = wanted;
+    }
+
+    //
+    // Waiting that long would leave no time for the attempt itself, so
+    // there's no point.
+    //
+    unsigned long now = millis();
+
+    if (m_deadline > 0 && now - m_begun + delay >= m_deadline)
+        return false;
+
+    m_timings.total = now - m_started;
+
+    if (m_first_byte)
+        record_timings();
+
+    release(false);
+    reset();
+
+    m_attempt += 1;
+    m_retry_at = now + delay;
+    m_state = URL_FETCH_WAITING;
+    return true;
+}
+
+
+/*
+ * Advance our fetch, and return how far it has got.
+ */
+UrlFetcherState UrlFetcher::poll()
+{
+    if (m_state == URL_FETCH_WAITING)
+    {
+        if ((long)(millis() - m_retry_at) < 0)
+            return (m_state);
+
+        //
+        // Each attempt has the usual timeout, but mustn't run past
+        // the deadline.
+        //
+        m_started = millis();
+        m_attempt_timeout = m_timeout;
+
+        if (m_deadline > 0 && m_deadline - (m_started - m_begun) < m_timeout)
+            m_attempt_timeout = m_deadline - (m_started - m_begun);
+
+        m_state = URL_FETCH_CONNECTING;
+    }
+
+    if (m_state == URL_FETCH_CONNECTING)
+    {
+        //
+        // Connecting is the one step which blocks, so we return to the
+        // caller as soon as our request has been sent.
+        //
+        start();
+        return (m_state);
+    }
+
+    if (m_state != URL_FETCH_HEADERS && m_state != URL_FETCH_BODY)
+        return (m_state);
+
+    //
+    // We read as much as is available, and keep going until the body
+    // is complete, the server closes the connection, or we run out of
+    // time.  So as not to hog the caller we also give up after a short
+    // while, and continue on the next call.
+    //
+    // NOTE: The extra byte allows us to terminate the headers.
+    //
+    uint8_t buf[URL_FETCHER_BUFFER + 1];
+    unsigned long polled = millis();
+
+    while (! m_complete)
+    {
+        if (millis() - m_started > m_attempt_timeout)
+        {
+            Serial.println(">>> Client Timeout !");
+            break;
+        }
+
+        int n = m_client->read(buf, URL_FETCHER_BUFFER);
+
+        //
+        // Nothing to read?  Wait for more packetses, unless the
+        // server has closed the connection - which is how a body
+        // without a length ends, and the only way it is complete.
+        //
+        if (n <= 0)
+        {
+            if (! m_client->connected())
+            {
+                if (m_header_done && m_framing == FRAMING_CLOSE)
+                    m_complete = true;
+
+                break;
+            }
+
+            return (m_state);
+        }
+
+        if (! m_first_byte)
+        {
+            m_first_byte = true;
+            m_timings.ttfb = millis() - m_sent;
+        }
+
+        m_timings.bytes += n;
+        read_response(buf, n);
+
+        //
+        // The response may have been one worth retrying.
+        //
+        if (m_state == URL_FETCH_WAITING)
+            return (m_state);
+
+        if (millis() - polled >= URL_FETCHER_POLL_BUDGET)
+            return (m_state);
+    }
+
+    //
+    // If a reused connection was closed before we got anything back
+    // then the request may be retried, with a new connection if need be.
+    //
+    if (m_reused && ! m_complete && m_headers.length() == 0 &&
+            millis() - m_started <= m_attempt_timeout)
+    {
+        release(false);
+        m_state = URL_FETCH_CONNECTING;
+        return (m_state);
+    }
+
+    //
+    // A `304` is only of use if we still have the response it validates,
+    // and another fetch may have replaced that since we asked.  If so we
+    // ask again, without the validators.
+    //
+    if (m_complete && m_code == 304 && m_cached && cached() == NULL && ! m_unconditional)
+    {
+        release(m_persistent);
+        reset();
+        m_unconditional = true;
+        m_state = URL_FETCH_CONNECTING;
+        return (m_state);
+    }
+
+    //
+    // Otherwise a failure before any of the body was received, or part
+    // way through a download, may be worth trying again.
+    //
+    // NOTE: A body ended by the server closing the connection has been
+    // marked complete by now, so it is never retried - which would ask
+    // for a range beyond the end of a finished download.
+    //
+    if (! m_complete && retry())
+        return (m_state);
+
+    finish();
+    return (m_state);
+}
+
+
+/*
+ * Abandon our fetch, if it is still running.
+ */
+void UrlFetcher::cancel()
+{
+    if (m_state == URL_FETCH_WAITING || m_state == URL_FETCH_CONNECTING ||
+            m_state == URL_FETCH_HEADERS || m_state == URL_FETCH_BODY)
+        finish();
+}
+
+
+/*
+ * How long each phase of our fetch took.
+ */
+const UrlFetcherTimings &UrlFetcher::timings()
+{
+    return (m_timings);
+}
+
+
+/*
+ * The statistics for one of the hosts we've fetched from.
+ */
+const UrlFetcherHostStats *UrlFetcher::hostStats(int i)
+{
+    if (i < 0 || i >= URL_FETCHER_STATS_HOSTS || s_stats[i].fetches == 0)
+        return NULL;
+
+    return (&s_stats[i]);
+}
+
+
+/*
+ * Forget the statistics of all hosts.
+ */
+void UrlFetcher::resetStats()
+{
+    memset(s_stats, 0, sizeof(s_stats));
+}
+
+
+/*
+ * Update the range of a phase with a new value.
+ *
+ * The average is a moving one, weighted towards recent fetches.
+ */
+static void update_range(UrlFetcherRange &range, unsigned long value, bool first)
+{
+    if (first)
+    {
+        range.min = range.avg = range.max = value;
+        return;
+    }
+
+    if (value < range.min)
+        range.min = value;
+
+    if (value > range.max)
+        range.max = value;
+
+    range.avg = (long)range.avg + ((long)value - (long)range.avg) / 8;
+}
+
+
+/*
+ * Add our timings to the statistics of our host.
+ *
+ * If we've not seen the host before we replace the one with the
+ * fewest fetches.
+ */
+void UrlFetcher::record_timings()
+{
+    UrlFetcherHostStats *stats = NULL;
+
+    for (int i = 0; i < URL_FETCHER_STATS_HOSTS; i++)
+    {
+        UrlFetcherHostStats *s = &s_stats[i];
+
+        if (s->fetches > 0 && strncmp(s->host, m_host, sizeof(s->host) - 1) == 0)
+        {
+            stats = s;
+            break;
+        }
+
+        if (stats == NULL || s->fetches < stats->fetches)
+            stats = s;
+    }
+
+    bool first = (stats->fetches == 0 || strncmp(stats->host, m_host, sizeof(stats->host) - 1) != 0);
+
+    if (first)
+    {
+        memset(stats, 0, sizeof(*stats));
+
+        //
+        // A long host is truncated, and its stats shared with any
+        // other which has the same prefix.
+        //
+        size_t len = strnlen(m_host, sizeof(stats->host) - 1);
+        memcpy(stats->host, m_host, len);
+        stats->host[len] = '\0';
+    }
+
+    stats->fetches += 1;
+
+    update_range(stats->dns, m_timings.dns, first);
+    update_range(stats->connect, m_timings.connect, first);
+    update_range(stats->tls, m_timings.tls, first);
+    update_range(stats->ttfb, m_timings.ttfb, first);
+    update_range(stats->body, m_timings.body, first);
+    update_range(stats->total, m_timings.total, first);
+    update_range(stats->bytes, m_timings.bytes, first);
+}
+
+
+/*
+ * The number of bytes of the response-body we've received so far.
+ */
+size_t UrlFetcher::received()
+{
+    return (m_received);
+}
+
+
+/*
+ * Connect to our host, or reuse a pooled connection, and send our
+ * request.
+ *
+ * If we have a fresh copy of the response then there's no need to
+ * contact the server at all.
+ */
+void UrlFetcher::start()
+{
+    /*
+     * Still empty?  That's a bug
+     */
+    if (strlen(m_host) < 1)
+    {
+        Serial.println("BUG - UrlFetcher::start - empty host");
+        finish();
+        return;
+    }
+
+    m_cached = (m_caching && ! m_download && ! m_unconditional) ? cached() : NULL;
+
+    if (m_cached && m_cached->fresh && (long)(m_cached->expires - millis()) > 0)
+    {
+        s_cache_hits += 1;
+        m_headers = m_cached->headers;
+        index_headers();
+        m_complete = true;
+        m_received = m_cached->size;
+
+        if (m_cached->size > 0)
+            m_handler(m_cached->body, m_cached->size);
+
+        m_state = URL_FETCH_DONE;
+
+        if (m_done)
+            m_done(this);
+
+        return;
+    }
+
+    m_reused = acquire();
+
+    /*
+     * Open a new connection, if we couldn't reuse one.
+     */
+    if (! m_reused && ! open())
+    {
+        if (! retry())
+            finish();
+
+        return;
+    }
+
+    //
+    // Send the request in a single write, rather than a line at a
+    // time, so it doesn't sit waiting for the ACK of a partial packet
+    // on a reused connection.
+    //
+    //
+    // If we have a cached copy we ask the server to only send the
+    // response if it has changed.
+    //
+    // Similarly if we have part of a download we ask for the rest of
+    // it, so long as it hasn't changed.
+    //
+    char validators[160] = { '\0' };
+
+    if (m_cached && strlen(m_cached->etag) > 0)
+        snprintf(validators, sizeof(validators), "If-None-Match: %s\r\n", m_cached->etag);
+    else if (m_cached && strlen(m_cached->modified) > 0)
+        snprintf(validators, sizeof(validators), "If-Modified-Since: %s\r\n", m_cached->modified);
+
+    m_resume_from = 0;
+
+    if (m_download)
+    {
+        File part = SPIFFS.open(m_download_path + ".part", "r");
+        File tag = SPIFFS.open(m_download_path + ".tag", "r");
+
+        if (part && tag && part.size() > 0)
+        {
+            char value[128];
+            size_t len = tag.read((uint8_t *)value, sizeof(value) - 1);
+            value[len] = '\0';
+
+            if (len > 0)
+            {
+                m_resume_from = part.size();
+                snprintf(validators, sizeof(validators), "Range: bytes=%u-\r\nIf-Range: %s\r\n",
+                         (unsigned int)m_resume_from, value);
+            }
+        }
+    }
+
+    //
+    // The Host header only names the port if it isn't the default.
+    //
+    char port_suffix[12] = { '\0' };
+
+    if (m_port > 0)
+        snprintf(port_suffix, sizeof(port_suffix), ":%d", m_port);
+
+    char req[640];
+    int req_len = snprintf(req, sizeof(req),
+                           "GET %s HTTP/1.%c\r\n"
+                           "Host: %s%s\r\n"
+                           "User-Agent: %s\r\n"
+                           "Connection: %s\r\n"
+                           "%s"
+                           "%s"
+                           "\r\n",
+                           m_path, m_keep_alive ? '1' : '0',
+                           m_host, port_suffix,
+                           getAgent(),
+                           m_keep_alive ? "keep-alive" : "close",
+                           (m_compression && ! m_download) ? "Accept-Encoding: gzip, deflate\r\n" : "",
+                           validators);
+
+    if (req_len >= (int)sizeof(req))
+    {
+        Serial.println("BUG - UrlFetcher::start - request too long");
+        finish();
+        return;
+    }
+
+    m_client->write((const uint8_t *)req, req_len);
+    m_sent = millis();
+    m_state = URL_FETCH_HEADERS;
+}
+
+
+/*
+ * Process some of the response we've read.
+ *
+ * Until we've seen the blank line the data is appended to the
+ * headers, after that it is the body.
+ */
+void UrlFetcher::read_response(uint8_t *buf, int n)
+{
+    int offset = 0;
+
+    if (! m_header_done)
+    {
+        while (offset < n && ! m_header_done)
+        {
+            char c = buf[offset++];
+
+            if (m_line_blank && c == '\n')
+                m_header_done = true;
+            else if (c == '\n')
+                m_line_blank = true;
+            else if (c != '\r')
+                m_line_blank = false;
+        }
+
+        //
+        // Append what we've read to the headers, without the
+        // trailing newline if we found the end of them.
+        //
+        int len = m_header_done ? offset - 1 : offset;
+        char saved = buf[len];
+        buf[len] = '\0';
+        m_headers += (char *)buf;
+        buf[len] = saved;
+
+        //
+        // Now we have all the headers we parse the status-code,
+        // and how the body is framed, just the once.
+        //
+        if (! m_header_done)
+            return;
+
+        index_headers();
+
+        //
+        // A status worth retrying means we ignore the body, and
+        // try again later.
+        //
+        if (retryable(m_code) && retry())
+            return;
+
+        if (m_download)
+            open_download();
+
+        parse_framing();
+        m_state = URL_FETCH_BODY;
+        m_body_started = millis();
+    }
+
+    if (offset < n)
+        decode_body(buf + offset, n - offset);
+}
+
+
+/*
+ * Our fetch has finished, successfully or not.
+ *
+ * Return the connection to the pool if we can, update the cache, and
+ * let the caller know.
+ */
+void UrlFetcher::finish()
+{
+    release(m_complete && m_persistent);
+
+    if (m_download)
+        close_download();
+
+    //
+    // Record how long we took, if we heard from the server.
+    //
+    m_timings.total = millis() - m_started;
+
+    if (m_header_done)
+        m_timings.body = millis() - m_body_started;
+
+    if (m_first_byte)
+        record_timings();
+
+    //
+    // A compressed body is only complete if it decompressed cleanly.
+    //
+    if (m_inflater)
+    {
+        if (! m_inflater->finished())
+            m_complete = false;
+
+        delete(m_inflater);
+        m_inflater = NULL;
+    }
+
+    if (m_caching)
+    {
+        int status = m_code;
+
+        //
+        // Our entry may have been replaced by another fetch's.
+        //
+        m_cached = m_download ? NULL : cached();
+
+        if (status == 304 && m_cached)
+        {
+            //
+            // Our copy is still valid, so replay it, and update how
+            // long it remains fresh for.
+            //
+            s_cache_revalidations += 1;
+
+            //
+            // The validators come from the `304` response, but after
+            // that our headers are those of the cached response.
+            //
+            String revalidated = m_headers;
+            m_headers = m_cached->headers;
+            index_headers();
+            m_received = m_cached->size;
+
+            if (m_cached->size > 0)
+                m_handler(m_cached->body, m_cached->size);
+
+            String original = m_headers;
+            m_headers = revalidated;
+            index_headers();
+            store(true);
+            m_headers = original;
+            index_headers();
+        }
+        else
+        {
+            s_cache_misses += 1;
+
+            if (status == 200 && m_cacheable && m_complete)
+                store(false);
+        }
+    }
+
+    if (m_copy)
+    {
+        free(m_copy);
+        m_copy = NULL;
+        m_copy_size = 0;
+    }
+
+    m_state = URL_FETCH_DONE;
+
+    if (m_done)
+        m_done(this);
+}
+
+
+/*
+ * Open the file for our download, now we know what the server sent.
+ *
+ * A `206` continues our partial file, so long as it starts where we
+ * asked; a `200` replaces it.  Anything else leaves the partial file
+ * alone, and the body is discarded.
+ */
+void UrlFetcher::open_download()
+{
+    String part = m_download_path + ".part";
+    String tag = m_download_path + ".tag";
+
+    if (m_code == 206)
+    {
+        const char *range = find_header("content-range");
+
+        if (m_resume_from == 0 || range == NULL || strncmp(range, "bytes ", 6) != 0 ||
+                strtoul(range + 6, NULL, 10) != m_resume_from)
+        {
+            //
+            // Not what we asked for, so start again next time.
+            //
+            SPIFFS.remove(part);
+            SPIFFS.remove(tag);
+            return;
+        }
+
+        m_file = SPIFFS.open(part, "a");
+    }
+    else if (m_code == 200)
+    {
+        m_file = SPIFFS.open(part, "w");
+
+        //
+        // Remember how to tell whether the file has changed, if the
+        // server told us, so we can resume the download later.
+        //
+        SPIFFS.remove(tag);
+
+        const char *validator = find_header("etag");
+
+        if (validator == NULL || strncmp(validator, "W/", 2) == 0)
+            validator = find_header("last-modified");
+
+        if (validator && strlen(validator) < 128)
+        {
+            File f = SPIFFS.open(tag, "w");
+
+            if (f)
+            {
+                f.write((const uint8_t *)validator, strlen(validator));
+                f.close();
+            }
+        }
+    }
+    else if (m_code == 416)
+    {
+        //
+        // Our partial file is no use.
+        //
+        SPIFFS.remove(part);
+        SPIFFS.remove(tag);
+        return;
+    }
+    else
+    {
+        return;
+    }
+
+    if (! m_file)
+        Serial.println("BUG - UrlFetcher::open_download - failed to open file");
+
+    m_unflushed = 0;
+}
+
+
+/*
+ * Write some of the body to our download, flushing it every so often
+ * so that little is lost if we're interrupted.
+ */
+void UrlFetcher::write_download(const uint8_t *data, size_t len)
+{
+    if (! m_file)
+        return;
+
+    if (m_file.write(data, len) != len)
+    {
+        Serial.println("BUG - UrlFetcher::write_download - short write");
+        m_file.close();
+        return;
+    }
+
+    m_unflushed += len;
+
+    if (m_unflushed >= URL_FETCHER_FLUSH)
+    {
+        m_file.flush();
+        m_unflushed = 0;
+    }
+}
+
+
+/*
+ * Close our download, and move it into place if it is complete.
+ */
+void UrlFetcher::close_download()
+{
+    if (! m_file)
+        return;
+
+    m_file.close();
+
+    if (! m_complete)
+        return;
+
+    String part = m_download_path + ".part";
+
+    SPIFFS.remove(m_download_path);
+
+    if (SPIFFS.rename(part, m_download_path))
+    {
+        SPIFFS.remove(m_download_path + ".tag");
+        m_downloaded = true;
+    }
+}
+
+
+/*
+ * Pass some of the response-body to our handler, keeping a copy of
+ * it if we're caching.
+ */
+void UrlFetcher::deliver(const uint8_t *data, size_t len)
+{
+    if (m_cacheable && m_code == 200)
+    {
+        uint8_t *grown = NULL;
+
+        if (m_copy_size + len <= URL_FETCHER_CACHE_MAX_BODY)
+            grown = (uint8_t *)realloc(m_copy, m_copy_size + len);
+
+        if (grown)
+        {
+            m_copy = grown;
+            memcpy(m_copy + m_copy_size, data, len);
+            m_copy_size += len;
+        }
+        else
+        {
+            m_cacheable = false;
+        }
+    }
+
+    m_received += len;
+    m_handler(data, len);
+}
+
+
+/*
+ * Pass some of the response-body on, decompressing it if the server
+ * compressed it.
+ */
+void UrlFetcher::decompress(const uint8_t *data, size_t len)
+{
+    if (m_inflater)
+        m_inflater->write(data, len);
+    else
+        deliver(data, len);
+}
+
+
+/*
+ * Append some of the response-body to our stored copy.
+ *
+ * The body grows in proportion to its size, rather than being
+ * reallocated for every chunk we receive.
+ */
+void UrlFetcher::store_body(const uint8_t *data, size_t len)
+{
+    //
+    // If we know how large the body is we can allocate it once.
+    //
+    if (m_reserved == 0 && m_framing == FRAMING_LENGTH)
+    {
+        m_reserved = m_body.length() + m_remaining;
+        m_body.reserve(m_reserved);
+    }
+
+    if (m_body.length() + len > m_reserved)
+    {
+        m_reserved = (m_body.length() + len) * 2;
+        m_body.reserve(m_reserved);
+    }
+
+    append(m_body, data, len);
+}
+
+
+/*
+ * Find the cached response for our URL, if there is one.
+ */
+UrlFetcher::CachedResponse *UrlFetcher::cached()
+{
+    for (int i = 0; i < URL_FETCHER_CACHE_ENTRIES; i++)
+    {
+        CachedResponse *c = &s_cache[i];
+
+        if (c->url && strcmp(c->url, m_url) == 0)
+        {
+            c->last_used = millis();
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Cache the response we've just received, replacing the entry which
+ * was used least recently if we don't already have one.  The entry
+ * takes over `m_copy`, rather than copying it again.
+ *
+ * If the response was `revalidated` then we only update the validators
+ * and lifetime of our existing entry.
+ */
+void UrlFetcher::store(bool revalidated)
+{
+    char etag[sizeof(s_cache[0].etag)] = { '\0' };
+    char modified[sizeof(s_cache[0].modified)] = { '\0' };
+    const char *control;
+    bool fresh = false;
+    unsigned long max_age = 0;
+
+    if (find_header("ETag"))
+        strncpy(etag, find_header("ETag"), sizeof(etag) - 1);
+
+    if (find_header("Last-Modified"))
+        strncpy(modified, find_header("Last-Modified"), sizeof(modified) - 1);
+
+    if ((control = find_header("Cache-Control")) != NULL)
+    {
+        //
+        // We're not allowed to store this, so forget any copy we have.
+        //
+        if (strstr(control, "no-store") != NULL)
+        {
+            if (m_cached)
+            {
+                free(m_cached->url);
+                free(m_cached->headers);
+                free(m_cached->body);
+                memset(m_cached, 0, sizeof(*m_cached));
+                m_cached = NULL;
+            }
+
+            return;
+        }
+
+        const char *age = strstr(control, "max-age=");
+
+        if (age != NULL && strstr(control, "no-cache") == NULL)
+        {
+            max_age = strtoul(age + 8, NULL, 10);
+            fresh = true;
+        }
+    }
+
+    //
+    // Without a validator or a lifetime the copy is useless.
+    //
+    if (! fresh && strlen(etag) == 0 && strlen(modified) == 0)
+        return;
+
+    CachedResponse *c = m_cached;
+
+    if (! revalidated)
+    {
+        if (c == NULL)
+        {
+            for (int i = 0; i < URL_FETCHER_CACHE_ENTRIES; i++)
+            {
+                if (c == NULL || s_cache[i].url == NULL ||
+                        (c->url && s_cache[i].last_used < c->last_used))
+                    c = &s_cache[i];
+            }
+        }
+
+        free(c->url);
+        free(c->headers);
+        free(c->body);
+        memset(c, 0, sizeof(*c));
+        m_cached = NULL;
+
+        c->url = strdup(m_url);
+        c->headers = strdup(m_headers.c_str());
+
+        //
+        // If the heap is too low for the entry we leave the slot empty,
+        // rather than have a partial entry match our URL.
+        //
+        if (c->url == NULL || c->headers == NULL)
+        {
+            free(c->url);
+            free(c->headers);
+            memset(c, 0, sizeof(*c));
+            return;
+        }
+
+        c->body = m_copy;
+        c->size = m_copy_size;
+        m_copy = NULL;
+        m_copy_size = 0;
+    }
+
+    if (c == NULL)
+        return;
+
+    //
+    // A 304 response may omit the validators, in which case we
+    // keep the ones we had.
+    //
+    if (strlen(etag) > 0 || ! revalidated)
+        strcpy(c->etag, etag);
+
+    if (strlen(modified) > 0 || ! revalidated)
+        strcpy(c->modified, modified);
+
+    c->fresh = fresh;
+    c->expires = millis() + max_age * 1000;
+    c->last_used = millis();
+    m_cached = c;
+}
+
+
+/*
+ * Create the appropriate client-object, and connect to our host.
+ *
+ * For secure connections we offer any TLS session we have cached
+ * for the host, so that the server may resume it.
+ */
+bool UrlFetcher::open()
+{
+    IPAddress address;
+    unsigned long started = millis();
+
+    if (! DnsCache::resolve(m_host, address))
+        return false;
+
+    m_timings.dns = millis() - started;
+    started = millis();
+
+    if (! is_secure())
+    {
+        m_client = new WiFiClient;
+        m_client->setTimeout(m_attempt_timeout);
+
+        bool connected = m_client->connect(address, port());
+
+        m_timings.connect = millis() - started;
+        return connected;
+    }
+
+    //
+    // For secure connections we've only looked the host up so that we
+    // know how long it took, but the core remembers the answer, so the
+    // lookup made when connecting by name is usually cheap.
+    //
+    WiFiClientSecure *secure = new WiFiClientSecure();
+    m_client = secure;
+    secure->setTimeout(m_attempt_timeout);
+
+    //
+    // We don't validate certificates.
+    //
+    secure->setInsecure();
+
+    CachedSession *cached = session();
+    secure->setSession(cached->session);
+
+    //
+    // The first time we connect to a host we find the smallest
+    // fragment-length it will accept, if any.
+    //
+    if (m_small_tls && cached->fragment == 0)
+    {
+        static const int fragments[] = URL_FETCHER_TLS_FRAGMENTS;
+
+        cached->fragment = -1;
+
+        for (size_t i = 0; i < sizeof(fragments) / sizeof(fragments[0]); i++)
+        {
+            if (WiFiClientSecure::probeMaxFragmentLength(m_host, port(), fragments[i]))
+            {
+                cached->fragment = fragments[i];
+                break;
+            }
+        }
+    }
+
+    if (m_small_tls && cached->fragment > 0)
+        secure->setBufferSizes(cached->fragment, URL_FETCHER_TLS_SEND_BUFFER);
+
+    //
+    // NOTE: We connect by name, rather than via the DNS cache, as the
+    // name is needed for SNI and can't be given alongside an address.
+    //
+    bool connected = secure->connect(m_host, port());
+
+    //
+    // If we failed with small buffers, or the server didn't honour the
+    // fragment-length after all, then fall back to the defaults.
+    //
+    if (m_small_tls && cached->fragment > 0 && (! connected || ! secure->getMFLNStatus()))
+    {
+        cached->fragment = -1;
+        cached->valid = false;
+
+        delete(secure);
+        secure = new WiFiClientSecure();
+        m_client = secure;
+        secure->setTimeout(m_attempt_timeout);
+
+        secure->setInsecure();
+        secure->setSession(cached->session);
+        connected = secure->connect(m_host, port());
+    }
+
+    m_timings.tls = millis() - started;
+
+    if (! connected)
+    {
+        //
+        // The session might be why we failed, so forget it.
+        //
+        cached->valid = false;
+        return false;
+    }
+
+    //
+    // Record the buffer-sizes we settled on.
+    //
+    if (m_small_tls && cached->fragment > 0)
+    {
+        m_tls_rx = cached->fragment;
+        m_tls_tx = URL_FETCHER_TLS_SEND_BUFFER;
+    }
+    else
+    {
+        m_tls_rx = URL_FETCHER_TLS_DEFAULT_RX;
+        m_tls_tx = URL_FETCHER_TLS_DEFAULT_TX;
+    }
+
+    if (cached->valid)
+        s_session_hits += 1;
+    else
+        s_session_misses += 1;
+
+    cached->valid = true;
+    cached->last_used = millis();
+    return true;
+}
+
+
+/*
+ * Find the cached TLS session for our host.
+ *
+ * If there isn't one we take over the entry which was used least
+ * recently, invalidating the session it held.
+ */
+UrlFetcher::CachedSession *UrlFetcher::session()
+{
+    CachedSession *slot = NULL;
+
+    for (int i = 0; i < URL_FETCHER_SESSIONS; i++)
+    {
+        CachedSession *c = &s_sessions[i];
+
+        if (c->session && c->port == port() && strcmp(c->host, m_host) == 0)
+            return c;
+
+        if (slot == NULL || c->session == NULL ||
+                (slot->session && c->last_used < slot->last_used))
+            slot = c;
+    }
+
+    if (slot->session)
+        delete(slot->session);
+
+    strcpy(slot->host, m_host);
+    slot->port      = port();
+    slot->session   = new BearSSL::Session();
+    slot->valid     = false;
+    slot->fragment  = 0;
+    slot->last_used = millis();
+
+    return slot;
+}
+
+
+/*
+ * Take a connection to our host from the pool, if there is one.
+ */
+bool UrlFetcher::acquire()
+{
+    closeIdle();
+
+    for (int i = 0; m_keep_alive && i < URL_FETCHER_POOL_SIZE; i++)
+    {
+        PooledConnection *p = &s_pool[i];
+
+        if (p->client && p->port == port() && strcmp(p->host, m_host) == 0)
+        {
+            m_client = p->client;
+            m_tls_rx = p->tls_rx;
+            m_tls_tx = p->tls_tx;
+            p->client = NULL;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * Return our connection to the pool, if it may be reused.
+ *
+ * If the pool is full we replace the connection which has been
+ * idle the longest.
+ */
+void UrlFetcher::release(bool reusable)
+{
+    if (m_client == NULL)
+        return;
+
+    if (reusable && m_keep_alive)
+    {
+        PooledConnection *slot = NULL;
+
+        for (int i = 0; i < URL_FETCHER_POOL_SIZE; i++)
+        {
+            PooledConnection *p = &s_pool[i];
+
+            if (p->client == NULL)
+            {
+                slot = p;
+                break;
+            }
+
+            if (slot == NULL || p->last_used < slot->last_used)
+                slot = p;
+        }
+
+        if (slot->client)
+        {
+            slot->client->stop();
+            delete(slot->client);
+        }
+
+        strcpy(slot->host, m_host);
+        slot->port      = port();
+        slot->client    = m_client;
+        slot->tls_rx    = m_tls_rx;
+        slot->tls_tx    = m_tls_tx;
+        slot->last_used = millis();
+    }
+    else
+    {
+        m_client->stop();
+        delete(m_client);
+    }
+
+    m_client = NULL;
+}
+
+
+/*
+ * Find the value of the named response-header, ignoring case.
+ *
+ * Returns NULL if the header wasn't present.
+ */
+const char *UrlFetcher::find_header(const char *name)
+{
+    if (m_header_buf == NULL)
+        return NULL;
+
+    uint16_t hash = header_hash(name);
+
+    for (int i = 0; i < URL_FETCHER_HEADERS; i++)
+    {
+        HeaderIndex *h = &m_index[(hash + i) & (URL_FETCHER_HEADERS - 1)];
+
+        if (h->name == 0)
+            return NULL;
+
+        if (h->hash == hash && strcasecmp(m_header_buf + h->name, name) == 0)
+            return (m_header_buf + h->value);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Work out how the response-body is framed, from the headers.
+ */
+void UrlFetcher::parse_framing()
+{
+    const char *value;
+    int status = m_code;
+
+    m_framing     = FRAMING_CLOSE;
+    m_remaining   = 0;
+    m_chunk_state = CHUNK_SIZE;
+    m_chunk_blank = true;
+
+    //
+    // A HTTP/1.1 server may keep the connection open, unless it
+    // tells us otherwise.
+    //
+    m_persistent = (m_status != NULL && strncmp(m_status, "HTTP/1.1", 8) == 0);
+
+    if ((value = find_header("Connection")) != NULL &&
+            strcasecmp(value, "close") == 0)
+        m_persistent = false;
+
+    //
+    // Some responses never have a body.
+    //
+    if ((status >= 100 && status < 200) || status == 204 || status == 304)
+    {
+        m_framing  = FRAMING_NONE;
+        m_complete = true;
+    }
+    else if ((value = find_header("Transfer-Encoding")) != NULL &&
+             strcasecmp(value, "identity") != 0)
+    {
+        m_framing = FRAMING_CHUNKED;
+    }
+    else if ((value = find_header("Content-Length")) != NULL)
+    {
+        m_framing   = FRAMING_LENGTH;
+        m_remaining = strtoul(value, NULL, 10);
+        m_complete  = (m_remaining == 0);
+    }
+
+    //
+    // If the body ends when the connection closes we can't reuse it.
+    //
+    if (m_framing == FRAMING_CLOSE)
+        m_persistent = false;
+
+    //
+    // If we asked for the body to be compressed, and it is, then we
+    // decompress it as it arrives.
+    //
+    if (m_compression && ! m_complete &&
+            (value = find_header("Content-Encoding")) != NULL)
+    {
+        Inflater::format_t format = Inflater::RAW;
+        bool compressed = true;
+
+        if (strcasecmp(value, "gzip") == 0 || strcasecmp(value, "x-gzip") == 0)
+            format = Inflater::GZIP;
+        else if (strcasecmp(value, "deflate") == 0)
+            format = Inflater::ZLIB;
+        else
+            compressed = false;
+
+        if (compressed)
+        {
+            m_inflater = new Inflater(m_window);
+
+            bool ok = m_inflater->begin(format, [this](const uint8_t * data, size_t len)
+            {
+                deliver(data, len);
+            });
+
+            if (! ok)
+                Serial.println("BUG - UrlFetcher::parse_framing - no memory to decompress");
+        }
+    }
+}
+
+
+/*
+ * Pass some of the response-body to the handler.
+ *
+ * If the body is chunked we remove the chunk-sizes, and we stop
+ * once we've received all of it.
+ */
+void UrlFetcher::decode_body(const uint8_t *data, size_t len)
+{
+    //
+    // The body is read until the connection is closed.
+    //
+    if (m_framing == FRAMING_CLOSE)
+    {
+        decompress(data, len);
+        return;
+    }
+
+    //
+    // The body is a fixed size.
+    //
+    if (m_framing == FRAMING_LENGTH)
+    {
+        size_t n = len < m_remaining ? len : m_remaining;
+
+        if (n > 0)
+            decompress(data, n);
+
+        m_remaining -= n;
+
+        if (m_remaining == 0)
+            m_complete = true;
+
+        //
+        // Anything beyond the body is unexpected, so the
+        // connection shouldn't be reused.
+        //
+        if (n < len)
+            m_persistent = false;
+
+        return;
+    }
+
+    //
+    // If there is no body we shouldn't have been given anything.
+    //
+    if (m_framing == FRAMING_NONE)
+    {
+        m_persistent = false;
+        return;
+    }
+
+    //
+    // The body is chunked; each chunk is preceded by its size in
+    // hex, and followed by a newline.  A zero-sized chunk, and any
+    // trailing headers, end the body.
+    //
+    size_t i = 0;
+
+    while (i < len && ! m_complete)
+    {
+        if (m_chunk_state == CHUNK_DATA)
+        {
+            size_t n = len - i < m_remaining ? len - i : m_remaining;
+
+            decompress(data + i, n);
+            i += n;
+            m_remaining -= n;
+
+            if (m_remaining == 0)
+                m_chunk_state = CHUNK_END;
+
+            continue;
+        }
+
+        char c = data[i++];
+
+        switch (m_chunk_state)
+        {
+        case CHUNK_SIZE:
+            if (isxdigit(c))
+            {
+                m_remaining = (m_remaining << 4) | (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+                break;
+            }
+
+            if (c != '\n')
+            {
+                m_chunk_state = CHUNK_EXTENSION;
+                break;
+            }
+
+        // fall through
+        case CHUNK_EXTENSION:
+            if (c == '\n')
+            {
+                m_chunk_state = (m_remaining > 0) ? CHUNK_DATA : CHUNK_TRAILER;
+                m_chunk_blank = true;
+            }
+
+            break;
+
+        case CHUNK_END:
+            if (c == '\n')
+            {
+                m_chunk_state = CHUNK_SIZE;
+                m_remaining = 0;
+            }
+
+            break;
+
+        case CHUNK_TRAILER:
+            if (c == '\n' && m_chunk_blank)
+                m_complete = true;
+            else if (c == '\n')
+                m_chunk_blank = true;
+            else if (c != '\r')
+                m_chunk_blank = false;
+
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (i < len)
+        m_persistent = false;
+}
+
+
+/*
+ * Parse the URL into "host" + "path".
+ */
+void UrlFetcher::parse()
+{
+    /*
+     * Look for the host.
+     */
+    char *host_start = strstr(m_url, "://");
 
     if (host_start != NULL)
     {
@@ -457,11 +2317,31 @@ void UrlFetcher::parse()
         host_start += 3;
         char *host_end = host_start;
 
-        while (host_end[0] != '/')
+        while (host_end[0] != '/' && host_end[0] != '\0')
             host_end += 1;
 
-        strncpy(m_host, host_start, host_end - host_start);
-        strcpy(m_path, host_end);
+        size_t len = host_end - host_start;
+
+        if (len >= sizeof(m_host) || strlen(host_end) >= sizeof(m_path))
+        {
+            Serial.println("BUG - UrlFetcher::parse - URL too long");
+            return;
+        }
+
+        strncpy(m_host, host_start, len);
+        m_host[len] = '\0';
+        strcpy(m_path, host_end[0] ? host_end : "/");
+
+        /*
+         * Split off the port, if there is one.
+         */
+        char *colon = strchr(m_host, ':');
+
+        if (colon != NULL)
+        {
+            *colon = '\0';
+            m_port = atoi(colon + 1);
+        }
     }
     else
     {
@@ -477,3 +2357,149 @@ bool UrlFetcher::is_secure()
 {
     return (strncmp(m_url, "https://", 7) == 0);
 }
+
+
+/*
+ * Constructor.
+ */
+UrlFetchGroup::UrlFetchGroup()
+{
+    for (int i = 0; i < URL_FETCH_GROUP_SIZE; i++)
+        m_fetchers[i] = NULL;
+}
+
+
+/*
+ * Destructor.
+ *
+ * Abandon anything still running.
+ */
+UrlFetchGroup::~UrlFetchGroup()
+{
+    for (int i = 0; i < URL_FETCH_GROUP_SIZE; i++)
+    {
+        if (m_fetchers[i])
+        {
+            delete(m_fetchers[i]);
+            m_fetchers[i] = NULL;
+        }
+    }
+}
+
+
+/*
+ * Start a fetch, and add it to the group.
+ */
+bool UrlFetchGroup::add(UrlFetcher *fetcher, UrlFetcherBodyHandler handler, UrlFetcherDoneHandler done)
+{
+    for (int i = 0; i < URL_FETCH_GROUP_SIZE; i++)
+    {
+        if (m_fetchers[i] != NULL)
+            continue;
+
+        //
+        // The fetch mustn't outlast our deadline, even while it is
+        // blocked connecting.
+        //
+        if (m_has_deadline)
+        {
+            long remaining = (long)(m_deadline - millis());
+
+            fetcher->setTimeout(remaining > 0 ? remaining : 1);
+        }
+
+        m_fetchers[i] = fetcher;
+        fetcher->begin(handler, done);
+        return true;
+    }
+
+    Serial.println("BUG - UrlFetchGroup::add - too many fetches");
+    delete(fetcher);
+    return false;
+}
+
+
+/*
+ * Remove a fetch, without calling its completion-handler.
+ */
+void UrlFetchGroup::remove(UrlFetcher *fetcher)
+{
+    for (int i = 0; i < URL_FETCH_GROUP_SIZE; i++)
+    {
+        if (m_fetchers[i] == fetcher)
+        {
+            delete(m_fetchers[i]);
+            m_fetchers[i] = NULL;
+        }
+    }
+}
+
+
+/*
+ * Set the time by which our fetches must have finished.
+ */
+void UrlFetchGroup::setDeadline(unsigned long ms)
+{
+    m_deadline = millis() + ms;
+    m_has_deadline = (ms > 0);
+}
+
+
+/*
+ * Advance each of our fetches in turn, deleting those which are done.
+ */
+int UrlFetchGroup::poll()
+{
+    bool expired = m_has_deadline && (long)(millis() - m_deadline) >= 0;
+    int count = 0;
+
+    for (int i = 0; i < URL_FETCH_GROUP_SIZE; i++)
+    {
+        UrlFetcher *fetcher = m_fetchers[i];
+
+        if (fetcher == NULL)
+            continue;
+
+        if (expired)
+            fetcher->cancel();
+
+        if (fetcher->poll() == URL_FETCH_DONE)
+        {
+            delete(fetcher);
+            m_fetchers[i] = NULL;
+        }
+        else
+        {
+            count += 1;
+        }
+    }
+
+    return (count);
+}
+
+
+/*
+ * Wait for all of our fetches to finish.
+ */
+void UrlFetchGroup::wait()
+{
+    while (poll() > 0)
+        delay(1);
+}
+
+
+/*
+ * The number of fetches still running.
+ */
+int UrlFetchGroup::running()
+{
+    int count = 0;
+
+    for (int i = 0; i < URL_FETCH_GROUP_SIZE; i++)
+    {
+        if (m_fetchers[i] != NULL)
+            count += 1;
+    }
+
+    return (count);
+}
@@ -1,6 +1,16 @@
 #ifndef URL_FETCHER_H
 #define URL_FETCHER_H
 
+#include <functional>
+#include <FS.h>
+
+#include "inflater.h"
+
+namespace BearSSL
+{
+class Session;
+};
+
 /*
  * This is a simple class which can be used to make HTTP or HTTPS fetches.
  *
@@ -15,7 +25,275 @@
  *
  *    foo.setAgent( "moi.kissa/3.14" );
  *
+ * If the response is large you can process the body as it arrives,
+ * rather than storing it all in RAM:
+ *
+ *   int code = foo.stream( [](const uint8_t *data, size_t len) {
+ *       Serial.write(data, len);
+ *   });
+ *
+ * If you're making repeated requests to the same host you can ask for
+ * the connection to be kept open, and reused by later fetches:
+ *
+ *    foo.setKeepAlive( true );
+ *
+ * For https:// URLs you can reduce the RAM used by the TLS buffers,
+ * if the server supports the max-fragment-length extension:
+ *
+ *    foo.setSmallTLSBuffers( true );
+ *
+ * Responses may be cached, and revalidated with the server via their
+ * ETag or Last-Modified headers, by enabling the response-cache:
+ *
+ *    foo.setCaching( true );
+ *
+ * The response may be compressed by the server, and decompressed as
+ * it arrives, which can make a large difference on a slow network:
+ *
+ *    foo.setCompression( true );
+ *
+ * How long each phase of the fetch took is available afterwards, along
+ * with rolling statistics for each host:
+ *
+ *    Serial.println( foo.timings().ttfb );
+ *
+ * Failed fetches may be retried, after a growing delay, with a deadline
+ * which limits the time taken by all the attempts together:
+ *
+ *    foo.setRetries( 3 );
+ *    foo.setDeadline( 8000 );
+ *
+ * Bodies too large for RAM may be downloaded into a SPIFFS file instead,
+ * and an interrupted download is resumed from where it stopped:
+ *
+ *    if ( foo.download( "/image.dat" ) )
+ *        Serial.println( "Downloaded" );
+ *
+ * Finally a fetch can run in the background, while you do other things,
+ * by starting it and then polling it from your loop:
+ *
+ *    foo.begin( handler, [](UrlFetcher *f) { Serial.println(f->code()); } );
+ *
+ *    while ( foo.poll() != URL_FETCH_DONE )
+ *        do_other_things();
+ *
+ * Several background fetches may be run at once, over their own
+ * connections, by adding them to a group which is polled instead:
+ *
+ *    UrlFetchGroup group;
+ *
+ *    group.setDeadline( 10000 );
+ *    group.add( new UrlFetcher( "http://steve.fi/" ), handler, done );
+ *    group.add( new UrlFetcher( "http://example.com/" ), handler, done );
+ *
+ *    while ( group.poll() > 0 )
+ *        do_other_things();
+ *
+ */
+
+
+/*
+ * The size of the buffer we read the response into.
+ */
+#ifndef URL_FETCHER_BUFFER
+#define URL_FETCHER_BUFFER 512
+#endif
+
+/*
+ * How long we'll wait for a fetch to complete, in milliseconds.
+ */
+#ifndef URL_FETCHER_TIMEOUT
+#define URL_FETCHER_TIMEOUT 15000
+#endif
+
+/*
+ * The delay before the first retry of a failed fetch, and the most
+ * we'll wait between attempts, in milliseconds.
+ */
+#ifndef URL_FETCHER_BACKOFF
+#define URL_FETCHER_BACKOFF 500
+#endif
+
+#ifndef URL_FETCHER_BACKOFF_MAX
+#define URL_FETCHER_BACKOFF_MAX 8000
+#endif
+
+/*
+ * The most status-codes we'll treat as worth retrying.
+ */
+#ifndef URL_FETCHER_RETRY_CODES
+#define URL_FETCHER_RETRY_CODES 8
+#endif
+
+
+/*
+ * The longest a single call to `poll()` will spend reading the
+ * response, in milliseconds.
+ */
+#ifndef URL_FETCHER_POLL_BUDGET
+#define URL_FETCHER_POLL_BUDGET 10
+#endif
+
+
+/*
+ * The number of response-headers we'll index, which must be a power
+ * of two.  Any beyond that are only available via `headers()`.
+ */
+#ifndef URL_FETCHER_HEADERS
+#define URL_FETCHER_HEADERS 32
+#endif
+
+
+/*
+ * The number of hosts we keep timing statistics for.
+ */
+#ifndef URL_FETCHER_STATS_HOSTS
+#define URL_FETCHER_STATS_HOSTS 4
+#endif
+
+
+/*
+ * The number of fetches a group may run at once.
+ */
+#ifndef URL_FETCH_GROUP_SIZE
+#define URL_FETCH_GROUP_SIZE 4
+#endif
+
+
+/*
+ * The number of idle connections we'll keep open for reuse, and how
+ * long they may sit idle before we close them, in milliseconds.
+ */
+#ifndef URL_FETCHER_POOL_SIZE
+#define URL_FETCHER_POOL_SIZE 2
+#endif
+
+#ifndef URL_FETCHER_POOL_IDLE
+#define URL_FETCHER_POOL_IDLE 30000
+#endif
+
+
+/*
+ * The number of hosts we'll remember TLS sessions for, so that
+ * later connections can resume them rather than making a full
+ * handshake.
+ */
+#ifndef URL_FETCHER_SESSIONS
+#define URL_FETCHER_SESSIONS 2
+#endif
+
+
+/*
+ * The TLS fragment-lengths we'll try to negotiate, smallest first,
+ * and the size of our TLS send-buffer when one is accepted.
+ */
+#ifndef URL_FETCHER_TLS_FRAGMENTS
+#define URL_FETCHER_TLS_FRAGMENTS { 512, 1024, 2048, 4096 }
+#endif
+
+#ifndef URL_FETCHER_TLS_SEND_BUFFER
+#define URL_FETCHER_TLS_SEND_BUFFER 512
+#endif
+
+/*
+ * The sizes of the TLS buffers BearSSL uses by default.
+ */
+#define URL_FETCHER_TLS_DEFAULT_RX (16384 + 325)
+#define URL_FETCHER_TLS_DEFAULT_TX 837
+
+
+/*
+ * The number of responses we'll cache, and the largest body we'll
+ * store.  Larger responses are never cached.
+ */
+#ifndef URL_FETCHER_CACHE_ENTRIES
+#define URL_FETCHER_CACHE_ENTRIES 2
+#endif
+
+#ifndef URL_FETCHER_CACHE_MAX_BODY
+#define URL_FETCHER_CACHE_MAX_BODY 1024
+#endif
+
+/*
+ * How much of a download we'll write to its file between flushes.
+ */
+#ifndef URL_FETCHER_FLUSH
+#define URL_FETCHER_FLUSH 4096
+#endif
+
+
+/*
+ * A body-handler is given the body of the response in chunks,
+ * as it is received from the remote server.
+ */
+typedef std::function<void(const uint8_t *data, size_t len)> UrlFetcherBodyHandler;
+
+/*
+ * A completion-handler is called when a background fetch has finished,
+ * successfully or not.
+ */
+class UrlFetcher;
+typedef std::function<void(UrlFetcher *fetcher)> UrlFetcherDoneHandler;
+
+/*
+ * How long each phase of a fetch took, in milliseconds, and the
+ * number of bytes we read from the server.
+ *
+ * The core makes a secure connection in one step, so for those `tls`
+ * includes the TCP connection, and `connect` is zero.  A reused
+ * connection has no DNS, connect, or TLS time at all.
+ */
+struct UrlFetcherTimings
+{
+    unsigned long dns;
+    unsigned long connect;
+    unsigned long tls;
+    unsigned long ttfb;
+    unsigned long body;
+    unsigned long total;
+    unsigned long bytes;
+};
+
+/*
+ * The smallest, average, and largest value seen for one phase.
+ */
+struct UrlFetcherRange
+{
+    unsigned long min;
+    unsigned long avg;
+    unsigned long max;
+};
+
+/*
+ * Rolling statistics for the fetches made from one host.
+ */
+struct UrlFetcherHostStats
+{
+    char host[64];
+    unsigned long fetches;
+    UrlFetcherRange dns;
+    UrlFetcherRange connect;
+    UrlFetcherRange tls;
+    UrlFetcherRange ttfb;
+    UrlFetcherRange body;
+    UrlFetcherRange total;
+    UrlFetcherRange bytes;
+};
+
+/*
+ * How far a background fetch has got, as returned by `poll()`.
  */
+typedef enum
+{
+    URL_FETCH_IDLE,
+    URL_FETCH_WAITING,
+    URL_FETCH_CONNECTING,
+    URL_FETCH_HEADERS,
+    URL_FETCH_BODY,
+    URL_FETCH_DONE
+} UrlFetcherState;
+
+
 class UrlFetcher
 {
 public:
@@ -46,16 +324,163 @@ public:
      */
     String body();
 
+    /*
+     * Fetch the remote URL, passing the body to the given handler
+     * as it arrives rather than storing it.
+     *
+     * The headers, status-line and code are available as normal, and
+     * `code()` may be called from within the handler.
+     *
+     * Returns the HTTP status-code, as `code()` would.
+     */
+    int stream(UrlFetcherBodyHandler handler);
+
+    /*
+     * Start fetching the remote URL in the background.
+     *
+     * The body is passed to the given handler as it arrives, or stored
+     * for `body()` if there is no handler.  Once the fetch has finished
+     * the completion-handler is called, if there is one.
+     *
+     * NOTE: Connecting to the server, and any TLS handshake, still block
+     * for up to the timeout, as the core has no way to avoid that.
+     */
+    void begin(UrlFetcherBodyHandler handler = nullptr, UrlFetcherDoneHandler done = nullptr);
+
+    /*
+     * Download the remote URL into the named SPIFFS file.
+     *
+     * The body is written to "<path>.part" as it arrives, and renamed
+     * to the given path once it is complete, replacing any previous
+     * copy.  If a partial file remains from an earlier attempt we ask
+     * the server for the rest of it, via a `Range` request, and the
+     * server's validator is kept in "<path>.tag" so that we start
+     * again if the file has changed in the meantime.
+     *
+     * With retries enabled an attempt which fails part-way through is
+     * resumed too, rather than given up.  Downloads are never cached
+     * or compressed.
+     *
+     * Returns true if the file is complete.
+     */
+    bool download(const char *path);
+
+    /*
+     * Start a download in the background, which is then polled like
+     * any other fetch.
+     */
+    void beginDownload(const char *path, UrlFetcherDoneHandler done = nullptr);
+
+    /*
+     * Advance a background fetch, processing whatever has arrived, and
+     * return how far it has got.
+     *
+     * This should be called regularly until it returns URL_FETCH_DONE.
+     * The fetcher must not be deleted from within the handlers.
+     */
+    UrlFetcherState poll();
+
+    /*
+     * How long each phase of our fetch took.
+     *
+     * Fetches served from the response-cache have no timings.
+     */
+    const UrlFetcherTimings &timings();
+
+    /*
+     * The timing statistics of the hosts we've fetched from, or NULL
+     * once `i` is beyond the last of them.
+     *
+     * The average is a moving one, weighted towards recent fetches.
+     */
+    static const UrlFetcherHostStats *hostStats(int i);
+
+    /*
+     * Forget the timing statistics of all hosts.
+     */
+    static void resetStats();
+
+    /*
+     * Abandon a background fetch.
+     *
+     * The completion-handler is called, as it would be if we'd timed out.
+     */
+    void cancel();
+
+    /*
+     * The number of bytes of the response-body received so far.
+     */
+    size_t received();
+
     /*
      * Return the HTTP status-code of our fetch.
      */
     int code();
 
+    /*
+     * Did we receive the complete response?
+     *
+     * This is false if the connection was closed, or we timed out,
+     * before we'd received all of the body the server promised.
+     */
+    bool complete();
+
+    /*
+     * Set how long we'll wait for the whole fetch to complete, in
+     * milliseconds.  The default is URL_FETCHER_TIMEOUT.
+     */
+    void setTimeout(unsigned long ms);
+
+    /*
+     * Set how many times we'll attempt the fetch, and the delays
+     * between attempts.  The default is a single attempt.
+     *
+     * The delay doubles after each failure, up to the maximum, and
+     * a random part of it is dropped so that many clients don't all
+     * retry at once.  A server's `Retry-After` is honoured too.
+     *
+     * An attempt is only retried if none of the body has been given
+     * to the handler - i.e. if we couldn't connect, the connection
+     * failed before the body, or the status-code is a retryable one.
+     */
+    void setRetries(int attempts,
+                    unsigned long backoff = URL_FETCHER_BACKOFF,
+                    unsigned long backoff_max = URL_FETCHER_BACKOFF_MAX);
+
+    /*
+     * Set the status-codes which are worth retrying.
+     *
+     * The defaults are 408, 429, 500, 502, 503, & 504.
+     */
+    void setRetryCodes(const int *codes, int count);
+
+    /*
+     * Set a deadline for the fetch, including all of its attempts and
+     * the delays between them, in milliseconds.  Each attempt's timeout
+     * is cut short so as not to pass it.  Zero, the default, means
+     * that there is no deadline.
+     */
+    void setDeadline(unsigned long ms);
+
+    /*
+     * The number of attempts our last fetch made.
+     */
+    int attempts();
+
     /*
      * Return the complete status-line of the remote server
      */
     char *status();
 
+    /*
+     * Return the value of the named response-header, ignoring the case
+     * of the name, or NULL if it wasn't present.
+     *
+     * The headers are indexed once, when they're received, so this is
+     * cheap to call and doesn't allocate memory.
+     */
+    const char *header(const char *name);
+
 
     /*
      * Get the user-agent, if one hasn't been set it will be created
@@ -70,8 +495,160 @@ public:
     void setAgent(const char *userAgent);
 
 
+    /*
+     * Make a HTTP/1.1 request, and return the connection to a pool
+     * afterwards so that later fetches to the same host may reuse it.
+     */
+    void setKeepAlive(bool enabled);
+
+
+    /*
+     * Close pooled connections which have been idle for too long, or
+     * which the server has closed.
+     *
+     * If `all` is true then every pooled connection is closed.
+     */
+    static void closeIdle(bool all = false);
+
+
+    /*
+     * The number of secure connections which offered a cached TLS
+     * session for resumption, and the number which had nothing
+     * cached and so made a full handshake.
+     */
+    static unsigned long sessionHits();
+    static unsigned long sessionMisses();
+
+
+    /*
+     * Negotiate the smallest TLS fragment-length the server accepts,
+     * and size our TLS buffers to match.
+     *
+     * The server is probed once, and the result remembered.  If it
+     * doesn't support the extension we use the default buffers.
+     */
+    void setSmallTLSBuffers(bool enabled);
+
+
+    /*
+     * The size of the TLS receive & send buffers used by our
+     * connection, or zero if the connection wasn't secure.
+     */
+    int tlsReceiveBuffer();
+    int tlsSendBuffer();
+
+
+    /*
+     * Cache successful responses to our URL.
+     *
+     * A cached response is returned without contacting the server
+     * while it is fresh, as determined by `Cache-Control: max-age`.
+     * After that we make a conditional request, and reuse the cached
+     * body if the server replies `304 Not Modified`.
+     */
+    void setCaching(bool enabled);
+
+
+    /*
+     * The number of fetches which were served from the cache without
+     * contacting the server, which were revalidated by the server, and
+     * which downloaded the response.
+     */
+    static unsigned long cacheHits();
+    static unsigned long cacheRevalidations();
+    static unsigned long cacheMisses();
+
+
+    /*
+     * Ask for the response to be compressed with gzip or deflate, and
+     * decompress it as it arrives.
+     *
+     * The decompressed body is seen by the handler, `body()`, and the
+     * cache.  The window is the amount of previous output we keep for
+     * the decompression; see `inflater.h` for the limits that implies.
+     */
+    void setCompression(bool enabled, size_t window = INFLATER_WINDOW);
+
+
 private:
 
+    /*
+     * An idle connection, which may be reused.
+     */
+    struct PooledConnection
+    {
+        char host[128];
+        int port;
+        WiFiClient *client;
+        int tls_rx;
+        int tls_tx;
+        unsigned long last_used;
+    };
+
+    /*
+     * Our pool of idle connections.
+     */
+    static PooledConnection s_pool[URL_FETCHER_POOL_SIZE];
+
+    /*
+     * A TLS session, which may be resumed by later connections.
+     */
+    struct CachedSession
+    {
+        char host[128];
+        int port;
+        BearSSL::Session *session;
+        bool valid;
+        int fragment;
+        unsigned long last_used;
+    };
+
+    /*
+     * Our cache of TLS sessions, and how useful it has been.
+     */
+    static CachedSession s_sessions[URL_FETCHER_SESSIONS];
+    static unsigned long s_session_hits;
+    static unsigned long s_session_misses;
+
+    /*
+     * A cached response, and the validators we use to revalidate it.
+     */
+    struct CachedResponse
+    {
+        char *url;
+        char *headers;
+        uint8_t *body;
+        size_t size;
+        char etag[64];
+        char modified[32];
+        bool fresh;
+        unsigned long expires;
+        unsigned long last_used;
+    };
+
+    /*
+     * Our timing statistics, per host.
+     */
+    static UrlFetcherHostStats s_stats[URL_FETCHER_STATS_HOSTS];
+
+    /*
+     * Our cache of responses, and how useful it has been.
+     */
+    static CachedResponse s_cache[URL_FETCHER_CACHE_ENTRIES];
+    static unsigned long s_cache_hits;
+    static unsigned long s_cache_revalidations;
+    static unsigned long s_cache_misses;
+
+    /*
+     * How the end of the response-body is found.
+     */
+    enum framing_t { FRAMING_CLOSE, FRAMING_LENGTH, FRAMING_CHUNKED, FRAMING_NONE };
+
+    /*
+     * Where we are within a chunked response-body.
+     */
+    enum chunk_state_t { CHUNK_SIZE, CHUNK_EXTENSION, CHUNK_DATA, CHUNK_END, CHUNK_TRAILER };
+
     /*
      * Get the host-part of the URL.
      */
@@ -91,7 +668,8 @@ private:
 
 
     /*
-     * Return the port we'll connect to, 80 for HTTP, 443 for HTTPS.
+     * Return the port we'll connect to, 80 for HTTP, 443 for HTTPS,
+     * unless the URL gave another.
      */
     int port();
 
@@ -108,6 +686,147 @@ private:
      */
     void fetch();
 
+    /*
+     * Perform the fetch of the remote URL, recording the
+     * response-headers and passing the body to the given handler.
+     */
+    void fetch(UrlFetcherBodyHandler handler);
+
+    /*
+     * Connect, over a pooled connection if we can, and send our request.
+     */
+    void start();
+
+    /*
+     * Process some of the response, which we've just read.
+     */
+    void read_response(uint8_t *buf, int n);
+
+    /*
+     * Tidy up once our fetch has finished, and call the completion-handler.
+     */
+    void finish();
+
+    /*
+     * Add our timings to the statistics of our host.
+     */
+    void record_timings();
+
+    /*
+     * Forget the response of a previous attempt.
+     */
+    void reset();
+
+    /*
+     * Is the given status-code worth retrying?
+     */
+    bool retryable(int code);
+
+    /*
+     * Abandon the current attempt, and arrange for another one after
+     * a suitable delay.
+     *
+     * Returns false if we can't, or mustn't, try again.
+     */
+    bool retry();
+
+    /*
+     * Open the file for our download, once we've seen the headers,
+     * and write some of the body to it.
+     */
+    void open_download();
+    void write_download(const uint8_t *data, size_t len);
+
+    /*
+     * Close our download, and if it is complete move it into place.
+     */
+    void close_download();
+
+    /*
+     * Pass some of the response-body to the handler.
+     */
+    void deliver(const uint8_t *data, size_t len);
+
+    /*
+     * Pass some of the response-body to the handler, decompressing
+     * it first if need be.
+     */
+    void decompress(const uint8_t *data, size_t len);
+
+    /*
+     * Append some of the response-body to `m_body`.
+     */
+    void store_body(const uint8_t *data, size_t len);
+
+    /*
+     * Find the cached response for our URL, if there is one.
+     */
+    CachedResponse *cached();
+
+    /*
+     * Cache the response we've just received, handing it our copy of
+     * the body, or update the lifetime of the entry it revalidated.
+     */
+    void store(bool revalidated);
+
+    /*
+     * Open a new connection to our host.
+     */
+    bool open();
+
+    /*
+     * Find the cached TLS session for our host, creating one if needed.
+     */
+    CachedSession *session();
+
+    /*
+     * Take a connection to our host from the pool, if one is available.
+     */
+    bool acquire();
+
+    /*
+     * Return our connection to the pool, or close it if we can't.
+     */
+    void release(bool reusable);
+
+    /*
+     * An entry in our index of the response-headers; the hash of the
+     * name, and the offsets of the name & value within `m_header_buf`.
+     */
+    struct HeaderIndex
+    {
+        uint16_t hash;
+        uint16_t name;
+        uint16_t value;
+        uint16_t length;
+    };
+
+    /*
+     * Build the index of our response-headers, and parse the status-code.
+     */
+    void index_headers();
+
+    /*
+     * Find the value of the named response-header.
+     */
+    const char *find_header(const char *name);
+
+    /*
+     * Parse the status-code from the status-line of our headers.
+     */
+    int parse_code();
+
+    /*
+     * Determine how the response-body is framed, once we have the headers.
+     */
+    void parse_framing();
+
+    /*
+     * Pass some of the response-body to the handler, removing any
+     * chunked transfer-encoding.
+     */
+    void decode_body(const uint8_t *data, size_t len);
+
 
     /*
      * A copy of the URL we were constructed with.
@@ -119,6 +838,11 @@ private:
      */
     char m_host[128] = { '\0' };
 
+    /*
+     * The port given in the URL, if any.
+     */
+    int m_port = 0;
+
     /*
      * The path extracted from the URL.
      */
@@ -135,7 +859,7 @@ private:
      * NOTE: This might be the derived class `WiFiClientSecure`
      *
      */
-    WiFiClient *m_client;
+    WiFiClient *m_client = NULL;
 
     /*
      * Have we fetched the URL already?
@@ -148,15 +872,266 @@ private:
     String m_headers;
 
     /*
-     * The status-line.
+     * The status-code, parsed from the headers.
+     */
+    int m_code = -1;
+
+    /*
+     * How long we'll wait for the fetch to complete.
+     */
+    unsigned long m_timeout = URL_FETCHER_TIMEOUT;
+
+    /*
+     * The timeout of the current attempt, which may be shortened by
+     * our deadline.
+     */
+    unsigned long m_attempt_timeout = URL_FETCHER_TIMEOUT;
+
+    /*
+     * How many attempts we'll make, how many we've made, the delays
+     * between them, and the status-codes worth retrying.
+     */
+    int m_attempts = 1;
+    int m_attempt = 0;
+    unsigned long m_backoff = URL_FETCHER_BACKOFF;
+    unsigned long m_backoff_max = URL_FETCHER_BACKOFF_MAX;
+    int m_retry_codes[URL_FETCHER_RETRY_CODES] = { 408, 429, 500, 502, 503, 504 };
+    int m_retry_count = 6;
+
+    /*
+     * Our deadline, relative to when the fetch began, when that was,
+     * and when we'll next attempt it.
+     */
+    unsigned long m_deadline = 0;
+    unsigned long m_begun = 0;
+    unsigned long m_retry_at = 0;
+
+    /*
+     * The status-line, within `m_header_buf`.
      */
     char *m_status = NULL;
 
+    /*
+     * A copy of the headers, with each line & name terminated, and
+     * the index of them.
+     */
+    char *m_header_buf = NULL;
+    HeaderIndex m_index[URL_FETCHER_HEADERS];
+
     /*
      * The body returned from the remote HTTP-fetch.
      */
     String m_body;
 
+    /*
+     * Should we keep the connection open for reuse?
+     */
+    bool m_keep_alive = false;
+
+    /*
+     * May the server keep the connection open after this response?
+     */
+    bool m_persistent = false;
+
+    /*
+     * How the response-body is framed, and how much of it remains,
+     * either in total or in the current chunk.
+     */
+    framing_t m_framing = FRAMING_CLOSE;
+    size_t m_remaining = 0;
+    chunk_state_t m_chunk_state = CHUNK_SIZE;
+    bool m_chunk_blank = true;
+
+    /*
+     * Should we negotiate small TLS buffers?
+     */
+    bool m_small_tls = false;
+
+    /*
+     * The TLS buffer-sizes used by our connection.
+     */
+    int m_tls_rx = 0;
+    int m_tls_tx = 0;
+
+    /*
+     * Should we cache our response?
+     */
+    bool m_caching = false;
+
+    /*
+     * The cached response we're revalidating, if any.  The cache is
+     * shared, so this is looked up again as each attempt starts, and
+     * as it finishes.
+     */
+    CachedResponse *m_cached = NULL;
+
+    /*
+     * Set if the response we were revalidating was replaced before the
+     * server's `304` arrived, so that we must ask again without it.
+     */
+    bool m_unconditional = false;
+
+    /*
+     * Should we ask for a compressed response, and with what window
+     * will we decompress it?
+     */
+    bool m_compression = false;
+    size_t m_window = INFLATER_WINDOW;
+
+    /*
+     * Are we downloading to a file, and if so which one, where we
+     * asked the server to start, and how much we've written to it
+     * since we last flushed it?
+     */
+    bool m_download = false;
+    String m_download_path;
+    File m_file;
+    size_t m_resume_from = 0;
+    size_t m_unflushed = 0;
+
+    /*
+     * Did our download complete, and get moved into place?
+     */
+    bool m_downloaded = false;
+
+    /*
+     * The decompressor for the body, if it is compressed.
+     */
+    Inflater *m_inflater = NULL;
+
+    /*
+     * The copy of the body we'll cache, and whether it is still small
+     * enough to be cached.
+     */
+    uint8_t *m_copy = NULL;
+    size_t m_copy_size = 0;
+    bool m_cacheable = false;
+
+    /*
+     * Have we read the complete response-body?
+     */
+    bool m_complete = false;
+
+    /*
+     * How far our fetch has got, and when it started.
+     */
+    UrlFetcherState m_state = URL_FETCH_IDLE;
+    unsigned long m_started = 0;
+
+    /*
+     * The handlers for the body, and for the completion of our fetch.
+     */
+    UrlFetcherBodyHandler m_handler;
+    UrlFetcherDoneHandler m_done;
+
+    /*
+     * Have we seen the end of the headers, and is the current line
+     * of them blank so far?
+     */
+    bool m_header_done = false;
+    bool m_line_blank = true;
+
+    /*
+     * How long each phase of our fetch took, when we sent our request,
+     * whether we've had any response, and when the body started.
+     */
+    UrlFetcherTimings m_timings = {};
+    unsigned long m_sent = 0;
+    bool m_first_byte = false;
+    unsigned long m_body_started = 0;
+
+    /*
+     * Are we using a connection from the pool?
+     */
+    bool m_reused = false;
+
+    /*
+     * How much of the body we've received, and how much space we've
+     * reserved for storing it.
+     */
+    size_t m_received = 0;
+    size_t m_reserved = 0;
+
+};
+
+
+
+/*
+ * A group of background fetches, which run concurrently over their
+ * own connections, and are driven by a single `poll()`.
+ */
+class UrlFetchGroup
+{
+public:
+
+    /*
+     * Constructor.
+     */
+    UrlFetchGroup();
+
+    /*
+     * Destructor.
+     *
+     * Any fetches still running are abandoned.
+     */
+    ~UrlFetchGroup();
+
+    /*
+     * Start the given fetch, as with `UrlFetcher::begin()`, and add it
+     * to the group.
+     *
+     * The fetcher must have been created with `new`, and the group
+     * deletes it once its completion-handler has returned.
+     *
+     * Returns false if the group is full, in which case the fetcher
+     * is deleted without being started.
+     */
+    bool add(UrlFetcher *fetcher, UrlFetcherBodyHandler handler = nullptr, UrlFetcherDoneHandler done = nullptr);
+
+    /*
+     * Remove a fetch from the group, and delete it, without calling
+     * its completion-handler.
+     *
+     * This must not be called from within the fetch's own handlers.
+     */
+    void remove(UrlFetcher *fetcher);
+
+    /*
+     * Set a deadline, this many milliseconds from now, by which all of
+     * our fetches must have finished.  Any still running are cancelled.
+     *
+     * Zero means that there is no deadline.
+     */
+    void setDeadline(unsigned long ms);
+
+    /*
+     * Advance all of our fetches, and return the number still running.
+     */
+    int poll();
+
+    /*
+     * Wait for all of our fetches to finish.
+     */
+    void wait();
+
+    /*
+     * The number of fetches still running.
+     */
+    int running();
+
+private:
+
+    /*
+     * Our fetches.
+     */
+    UrlFetcher *m_fetchers[URL_FETCH_GROUP_SIZE];
+
+    /*
+     * The time by which they must have finished, if we have one.
+     */
+    unsigned long m_deadline = 0;
+    bool m_has_deadline = false;
+
 };
 
 #endif /* URL_FETCHER_H */
@@ -2,15 +2,244 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <functional>
 
 /*
  * The maximum number of URL parameters we'll handle.
  */
 #define MAX_PARAMS 10
 
+/*
+ * The longest name & value of a POSTed form-field we'll handle, longer
+ * ones are truncated, and how much of the body we read at once.
+ */
+#ifndef FORM_NAME_MAX
+#define FORM_NAME_MAX 32
+#endif
+
+#ifndef FORM_VALUE_MAX
+#define FORM_VALUE_MAX 128
+#endif
+
+#ifndef FORM_CHUNK
+#define FORM_CHUNK 64
+#endif
+
+/*
+ * How long we'll wait for more of a POSTed body, in milliseconds.
+ */
+#ifndef FORM_TIMEOUT
+#define FORM_TIMEOUT 2000
+#endif
+
+
+/*
+ * The value of each ASCII hex-digit, or -1 for anything else.
+ */
+static const int8_t url_hex_table[128] =
+{
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/*
+ * A bitmap of the ASCII characters which needn't be escaped in a URL:
+ * letters, digits, and "-._~".
+ */
+static const uint8_t url_safe_table[16] =
+{
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0xff, 0x03,
+    0xfe, 0xff, 0xff, 0x87, 0xfe, 0xff, 0xff, 0x47
+};
+
+
+/*
+ * The value of a hex-digit, or -1 if it isn't one.
+ */
+static inline int url_hex(char c)
+{
+    return ((unsigned char)c < 128) ? url_hex_table[(unsigned char)c] : -1;
+}
+
+
+/*
+ * Find the bytes of a word which are a '%', a '+', or a NUL.
+ *
+ * This is the usual "has a zero byte" test, applied to the word and to
+ * the word XORed with each character we're looking for.  The lowest bit
+ * set in the result is the high bit of the first such byte; bits above
+ * that may be set spuriously.  A word is as wide as a pointer, so four
+ * bytes on the ESP8266, and eight on most hosts.
+ */
+static inline uintptr_t url_word_special(uintptr_t v)
+{
+    const uintptr_t ones = (uintptr_t) - 1 / 0xFF;
+    const uintptr_t highs = ones * 0x80;
+
+    uintptr_t pct = v ^ (ones * '%');
+    uintptr_t plus = v ^ (ones * '+');
+
+    return (((v - ones) & ~v) |
+            ((pct - ones) & ~pct) |
+            ((plus - ones) & ~plus)) & highs;
+}
+
+
+/*
+ * URL-decode the given string in place, returning its new length.
+ *
+ * We look at a word at a time, to find the next character which needs
+ * decoding, and move the ordinary characters before it all at once.
+ * Invalid escapes, such as "%zz", are left as they are.
+ *
+ * NOTE: We only ever load aligned words, which can't cross the end of
+ * the memory holding the string, so reading the bytes after its end
+ * is harmless.  The byte-order is assumed to be little-endian, as it
+ * is on the ESP8266 and x86.
+ */
+static inline size_t url_decode(char *str)
+{
+    const size_t word = sizeof(uintptr_t);
+
+    char *src = str;
+    char *dst = str;
+
+    //
+    // The word we last looked at, and where its special characters are.
+    //
+    const uintptr_t *last = NULL;
+    uintptr_t found = 0;
+
+    while (true)
+    {
+        //
+        // Look at the word containing `src`, ignoring the bytes before
+        // it, for the next special character.  We only write to bytes
+        // before `src`, so a word we've already looked at needn't be
+        // looked at again.
+        //
+        const uintptr_t *w = (const uintptr_t *)((uintptr_t)src & ~(word - 1));
+
+        if (w != last)
+        {
+            found = url_word_special(*w);
+            last = w;
+        }
+
+        size_t offset = src - (const char *)w;
+        uintptr_t special = found & ((uintptr_t) - 1 << (8 * offset));
+
+        size_t n = special ? __builtin_ctzl(special) / 8 - offset : word - offset;
+
+        //
+        // Until we've decoded something the characters are already
+        // where they belong; after that the runs are short, so are
+        // best copied directly.
+        //
+        if (dst == src)
+        {
+            src += n;
+            dst += n;
+        }
+        else
+        {
+            while (n-- > 0)
+                *dst++ = *src++;
+        }
+
+        if (! special)
+            continue;
+
+        char c = *src;
+
+        if (c == '\0')
+            break;
+
+        int hi, lo;
+
+        if (c == '+')
+        {
+            *dst++ = ' ';
+            src += 1;
+        }
+        else if (c == '%' && (hi = url_hex(src[1])) >= 0 && (lo = url_hex(src[2])) >= 0)
+        {
+            *dst++ = (char)((hi << 4) | lo);
+            src += 3;
+        }
+        else
+        {
+            *dst++ = c;
+            src += 1;
+        }
+    }
+
+    *dst = '\0';
+    return (dst - str);
+}
+
+
+/*
+ * URL-encode the given string into the buffer, escaping everything
+ * but letters, digits, and "-._~".
+ *
+ * Like `snprintf` the result is always terminated, and we return the
+ * length the whole result would have, so if that is not less than the
+ * size of the buffer the result was truncated - but never part-way
+ * through an escape.
+ */
+static inline size_t url_encode(const char *src, char *dst, size_t size)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    size_t len = 0;
+
+    for (; *src != '\0'; src++)
+    {
+        unsigned char c = *src;
+
+        if (c < 128 && (url_safe_table[c >> 3] & (1 << (c & 7))))
+        {
+            if (len + 1 < size)
+                dst[len] = c;
+
+            len += 1;
+        }
+        else
+        {
+            if (len + 3 < size)
+            {
+                dst[len] = '%';
+                dst[len + 1] = digits[c >> 4];
+                dst[len + 2] = digits[c & 15];
+            }
+            else if (len < size)
+            {
+                //
+                // Stop here, rather than write part of the escape.
+                //
+                size = len + 1;
+            }
+
+            len += 3;
+        }
+    }
+
+    if (size > 0)
+        dst[len < size ? len : size - 1] = '\0';
+
+    return len;
+}
+
 /*
  * This structure holds the name & value of a single URL
- * parameter.
+ * parameter, both of which point into the URL we were given.
  */
 struct UrlParam
 {
@@ -23,156 +252,107 @@ struct UrlParam
      * The value of the parameter.
      */
     char *value;
+
+    /**
+     * Has the value been URL-decoded yet?
+     */
+    bool decoded;
 };
 
 
 /**
  * A simple class to parse out the (GET) parameters from an URL.
+ *
+ * The URL is parsed in place, within the buffer we're given, so the
+ * buffer must outlive us, and will be modified.  Values are decoded
+ * the first time they're asked for.  Nothing is allocated.
  */
 class URL
 {
 public:
     /*
      * Constructor.
-     *
-     * Allocate space to hold some parameters.
      */
-    URL(const char *url)
+    URL(char *url)
     {
-        //
-        // Copy the URL into place.
-        //
-        m_url = strdup( url );
+        m_url = url;
 
         //
         // We'll cap the URL at the first space, if present.
         //
         // This allows the caller to be a bit sloppy :)
         //
-        char *x = strstr(m_url, " ");
+        char *x = strchr(m_url, ' ');
         if (x != NULL)
-            m_url[ x - m_url ] = '\0';
+            *x = '\0';
 
         //
         // We've not yet parsed the parameters.
         //
-        m_parsed = 0;
-
-        //
-        // Allocate some storage for the array of parameter-objects.
-        //
-        m_params = (UrlParam **)malloc(sizeof(struct UrlParam) * (MAX_PARAMS));
-
-        //
-        // Initialise each one.
-        //
-        for (int i = 0; i < MAX_PARAMS ; i++)
-        {
-            m_params[i] = (UrlParam*)malloc(sizeof(struct UrlParam));
-            m_params[i]->name = NULL;
-            m_params[i]->value = NULL;
-        }
-    }
-
-    /**
-     * Destructor.  Free up our dynamic allocations.
-     */
-    ~URL()
-    {
-        if (m_url)
-            free(m_url);
-
-        if (m_params)
-        {
-            for (int i = 0; i < MAX_PARAMS ; i++)
-            {
-                if (m_params[i]->name)
-                    free(m_params[i]->name);
-
-                if (m_params[i]->value)
-                    free(m_params[i]->value);
-
-                free(m_params[i]);
-            }
-
-            free(m_params);
-        }
+        m_parsed = false;
+        m_count = 0;
     }
 
     /**
-     * Parse any supplied URL-parameters, to a limit of 10, and update
-     * our internal array.
+     * Parse any supplied URL-parameters, to a limit of MAX_PARAMS, and
+     * update our internal array.
      *
-     * NOTE: This also URL-decodes the values.
+     * Each name & value is terminated in place, but the values aren't
+     * decoded until they're used.
      */
     void parse()
     {
-
-        //
-        // The count of parameters
-        //
-        int c = 0;
-
-
         //
         // If we've already parsed then return
         //
         if (m_parsed)
             return;
 
-        char* pch = NULL;
+        m_parsed = true;
 
         //
         // Do we have some params?
         //
-        char *x = strstr(m_url, "?");
+        char *pch = strchr(m_url, '?');
 
-        if (x == NULL)
+        if (pch == NULL)
             return;
 
+        pch += 1;
+
         //
         // Split by "&"
         //
-        pch = strtok(x + 1 , "&");
-
-        while (pch != NULL)
+        while (*pch != '\0' && m_count < MAX_PARAMS)
         {
             //
-            // We now have "blah=blah"
+            // Find the end of this "name=value" pair, and terminate it.
+            //
+            char *end = strchr(pch, '&');
+
+            if (end != NULL)
+                *end = '\0';
+
             //
             // We need to split the key/value
             //
-            char *equal = strstr(pch, "=");
+            char *equal = strchr(pch, '=');
 
             if (equal != NULL)
             {
-                //
-                // The name, truncated at the equals-sign
-                //
-                m_params[c]->name = strdup(pch);
-                m_params[c]->name[equal - pch ] = '\0';
+                *equal = '\0';
 
-                //
-                // The value, which is URL-decoded
-                //
-                m_params[c]->value = urldecode(equal + 1);
-
-                //
-                // Bump to the next parameter.
-                //
-                c += 1;
-
-                //
-                // We stop at the max-params.
-                //
-                if (c >= MAX_PARAMS)
-                    return;
+                m_params[m_count].name = pch;
+                m_params[m_count].value = equal + 1;
+                m_params[m_count].decoded = false;
+                m_count += 1;
             }
 
-            pch = strtok(NULL, "&");
-        }
+            if (end == NULL)
+                break;
 
-        m_parsed = 1;
+            pch = end + 1;
+        }
     }
 
     /**
@@ -184,11 +364,10 @@ public:
     {
         parse();
 
-        for (int i = 0; i < MAX_PARAMS ; i++)
+        for (int i = 0; i < m_count ; i++)
         {
-            if (m_params[i]->name &&
-                    strcmp(m_params[i]->name, name) == 0)
-                return (m_params[i]->value);
+            if (strcmp(m_params[i].name, name) == 0)
+                return (param_value(i));
         }
 
         return NULL;
@@ -201,15 +380,7 @@ public:
     {
         parse();
 
-        int count = 0;
-
-        for (int i = 0; i < MAX_PARAMS ; i++)
-        {
-            if (m_params[i]->name)
-                count += 1;
-        }
-
-        return count;
+        return m_count;
     }
 
     /**
@@ -219,10 +390,10 @@ public:
     {
         parse();
 
-        if (i > count())
+        if (i < 0 || i >= m_count)
             return NULL;
 
-        return (m_params[i]->name);
+        return (m_params[i].name);
     };
 
     /**
@@ -232,110 +403,309 @@ public:
     {
         parse();
 
-        if (i > count())
+        if (i < 0 || i >= m_count)
             return NULL;
 
-        return (m_params[i]->value);
+        if (! m_params[i].decoded)
+        {
+            url_decode(m_params[i].value);
+            m_params[i].decoded = true;
+        }
+
+        return (m_params[i].value);
     };
 
+
 private:
+    /*
+     * The URL we were created with.
+     */
+    char *m_url;
+
+    /*
+     * The array of parameter-name + values, and how many we found.
+     */
+    UrlParam m_params[MAX_PARAMS];
+    int m_count;
+
+    /*
+     * Have we parsed?
+     */
+    bool m_parsed;
+};
+
+
+/*
+ * A handler is given each name & value of a form, once decoded.
+ *
+ * The strings are only valid for the duration of the call.
+ */
+typedef std::function<void(const char *name, const char *value)> FormHandler;
+
+
+/**
+ * A streaming parser for `application/x-www-form-urlencoded` bodies,
+ * such as those POSTed by a HTML form.
+ *
+ * The body may be given to us in pieces of any size, and we decode
+ * it as it arrives - including escapes split between two pieces - so
+ * only one name & value is held in RAM at once:
+ *
+ *   FormParser form([](const char *name, const char *value) {
+ *       Serial.printf("%s -> %s\n", name, value);
+ *   });
+ *
+ *   form.read(client, FormParser::skipHeaders(client));
+ */
+class FormParser
+{
+public:
+    /*
+     * Constructor.
+     */
+    FormParser(FormHandler handler)
+    {
+        m_handler = handler;
+        reset();
+    }
 
     /**
-     * Decodes an URL from its percent-encoded form back into normal
-     * representation. This function returns the decoded URL in a string.
-     * The URL to be decoded does not necessarily have to be encoded but
-     * in that case the original string is duplicated.
-     *
-     * @param url a string to be decoded.
-     * @return new string with the URL decoded or NULL if decoding failed.
-     * Note that the returned string should be explicitly freed when not
-     * used anymore.
+     * Parse some more of the body.
      */
-    char *urldecode(const char *url)
+    void write(const char *data, size_t len)
     {
-        int s = 0, d = 0, url_len = 0;
-        char c;
-        char *dest = NULL;
+        for (size_t i = 0; i < len; i++)
+            parse(data[i]);
+    }
 
-        if (!url)
-            return NULL;
+    /**
+     * Mark the end of the body, passing on the final field.
+     */
+    void finish()
+    {
+        emit();
+    }
 
-        url_len = strlen(url) + 1;
-        dest = (char *)malloc(url_len);
+#ifdef ARDUINO
 
-        if (!dest)
-            return NULL;
+    /**
+     * Read the headers of a request from the client, after its
+     * request-line, and return the length of the body which follows.
+     */
+    static size_t skipHeaders(Stream &client)
+    {
+        char line[64];
+        size_t length = 0;
+
+        bool partial = false;
+
+        for (int i = 0; ; i++)
+        {
+            size_t n = client.readBytesUntil('\n', line, sizeof(line) - 1);
+            line[n] = '\0';
+
+            //
+            // Skip the rest of any line too long for our buffer.
+            //
+            bool continuation = partial;
+            partial = (n == sizeof(line) - 1);
+
+            if (continuation)
+                continue;
+
+            if (n > 0 && line[n - 1] == '\r')
+                line[--n] = '\0';
+
+            //
+            // A blank line marks the end of the headers, unless it is
+            // the remains of a request-line which was read up to its
+            // `\r`, rather than its `\n`.
+            //
+            if (n == 0)
+            {
+                if (i == 0)
+                    continue;
 
-        while (s < url_len)
+                break;
+            }
+
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+                length = strtoul(line + 15, NULL, 10);
+        }
+
+        return length;
+    }
+
+    /**
+     * Read and parse a body of the given length from the client, a
+     * chunk at a time.
+     *
+     * Returns the number of bytes we read, which is less than the
+     * length if the client disconnected, or stopped sending.
+     */
+    size_t read(Stream &client, size_t length, unsigned long timeout = FORM_TIMEOUT)
+    {
+        char buf[FORM_CHUNK];
+        size_t done = 0;
+        unsigned long last = millis();
+
+        while (done < length)
         {
-            c = url[s++];
+            int avail = client.available();
 
-            if (c == '%' && s + 2 < url_len)
+            if (avail <= 0)
             {
-                char c2 = url[s++];
-                char c3 = url[s++];
-
-                if (isxdigit(c2) && isxdigit(c3))
-                {
-                    c2 = tolower(c2);
-                    c3 = tolower(c3);
-
-                    if (c2 <= '9')
-                        c2 = c2 - '0';
-                    else
-                        c2 = c2 - 'a' + 10;
-
-                    if (c3 <= '9')
-                        c3 = c3 - '0';
-                    else
-                        c3 = c3 - 'a' + 10;
-
-                    dest[d++] = 16 * c2 + c3;
-
-                }
-                else     /* %zz or something other invalid */
-                {
-                    dest[d++] = c;
-                    dest[d++] = c2;
-                    dest[d++] = c3;
-                }
+                if (millis() - last > timeout)
+                    break;
+
+                delay(1);
+                continue;
             }
-            else if (c == '+')
+
+            size_t want = length - done;
+
+            if (want > sizeof(buf))
+                want = sizeof(buf);
+
+            if (want > (size_t)avail)
+                want = avail;
+
+            size_t n = client.readBytes(buf, want);
+            write(buf, n);
+
+            done += n;
+            last = millis();
+        }
+
+        finish();
+        return done;
+    }
+
+#endif
+
+private:
+
+    /**
+     * Process one character of the body.
+     */
+    void parse(char c)
+    {
+        //
+        // Part-way through an escape?
+        //
+        if (m_escape > 0)
+        {
+            if (url_hex(c) >= 0 && m_escape == 1)
             {
-                dest[d++] = ' ';
+                m_hex = c;
+                m_escape = 2;
+                return;
             }
-            else
+
+            if (url_hex(c) >= 0)
             {
-                dest[d++] = c;
+                add(url_hex(m_hex) * 16 + url_hex(c));
+                m_escape = 0;
+                return;
             }
 
+            //
+            // Not an escape after all, so keep what we saw as it was.
+            //
+            add('%');
+
+            if (m_escape == 2)
+                add(m_hex);
+
+            m_escape = 0;
         }
 
-        return dest;
-    };
+        if (c == '%')
+            m_escape = 1;
+        else if (c == '&')
+            emit();
+        else if (c == '=' && ! m_in_value)
+            m_in_value = true;
+        else if (c == '+')
+            add(' ');
+        else
+            add(c);
+    }
+
+    /**
+     * Append a decoded character to the current name or value.
+     */
+    void add(char c)
+    {
+        if (m_in_value && m_value_len < FORM_VALUE_MAX)
+            m_value[m_value_len++] = c;
+        else if (! m_in_value && m_name_len < FORM_NAME_MAX)
+            m_name[m_name_len++] = c;
+    }
+
+    /**
+     * Pass the current field to our handler, if it is complete,
+     * and prepare for the next one.
+     */
+    void emit()
+    {
+        if (m_escape > 0)
+        {
+            add('%');
+
+            if (m_escape == 2)
+                add(m_hex);
+        }
+
+        if (m_in_value && m_name_len > 0)
+        {
+            m_name[m_name_len] = '\0';
+            m_value[m_value_len] = '\0';
+            m_handler(m_name, m_value);
+        }
+
+        reset();
+    }
+
+    /**
+     * Forget the current field.
+     */
+    void reset()
+    {
+        m_name_len = 0;
+        m_value_len = 0;
+        m_in_value = false;
+        m_escape = 0;
+    }
 
 
 private:
     /*
-     * The URL we were created with.
+     * The handler we pass each field to.
      */
-    char *m_url;
+    FormHandler m_handler;
 
     /*
-     * The array of parameter-name + values.
+     * The name & value of the current field, and are we within the value?
      */
-    UrlParam **m_params;
+    char m_name[FORM_NAME_MAX + 1];
+    char m_value[FORM_VALUE_MAX + 1];
+    size_t m_name_len;
+    size_t m_value_len;
+    bool m_in_value;
 
     /*
-     * Have we parsed?
+     * How much of an escape we've seen, and its first digit.
      */
-    int m_parsed ;
+    int m_escape;
+    char m_hex;
 };
 
 #if 0
 int main(int argc, char *argv[])
 {
-    URL x("http://example.com/?foo=bar&ex=%2f&x=34&b=px");
+    char buf[] = "http://example.com/?foo=bar&ex=%2f&x=34&b=p+x%zz&c HTTP/1.1";
+    URL x(buf);
     printf("foo: %s\n", x.param("foo"));
     printf("bar: %s\n", x.param("bar"));
     printf("ex: %s\n", x.param("ex"));
@@ -346,5 +716,20 @@ int main(int argc, char *argv[])
     {
         printf("Param %d : %s -> %s\n", i, x.param_name(i), x.param_value(i));
     }
+
+    //
+    // Feed a form-body a byte at a time, so escapes are split.
+    //
+    FormParser form([](const char *name, const char *value)
+    {
+        printf("Form %s -> %s\n", name, value);
+    });
+
+    const char *body = "mq=mq.example.com&msg=Hello+%2Fworld%21&bad=%zz%4&x=1%";
+
+    for (size_t i = 0; i < strlen(body); i++)
+        form.write(body + i, 1);
+
+    form.finish();
 }
 #endif
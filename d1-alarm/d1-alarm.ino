@@ -385,37 +385,18 @@ void callback(char* topic, byte* payload, unsigned int length)
 //
 // Reconnect to the pub-sub-server, if we're dropped.
 //
+// This never blocks: each call takes the next step of connecting, and
+// the library waits, longer after each failure, between attempts.
+//
 void reconnect()
 {
-    //
-    // Keep track of connection-attempts.
-    //
-    // If there are too many failures we'll just
-    // abort.
-    //
-    static int count = 0;
-
-    if (count > 5)
-        return;
-
-    //
-    // Bump our attempt-count.
-    //
-    count += 1;
-
-    // Attempt to reconnect
-    DEBUG_LOG("Attempting MQTT connection...");
+    static String id = String(PROJECT_NAME) + board_info.mac();
+    static int last_state = MQTT_DISCONNECTED;
 
-    String id = PROJECT_NAME;
-    id += board_info.mac();
-
-    // Attempt to connect
-    if (client.connect(id.c_str()))
+    if (client.connectAsync(id.c_str()))
     {
-        //
         // We've connected
-        //
-        DEBUG_LOG("connected\n");
+        DEBUG_LOG("MQTT connected\n");
 
         //
         // Dump all our local details to the meta-topic
@@ -426,17 +407,13 @@ void reconnect()
         // Subscribe to the `meta`-topic.
         //
         client.subscribe("meta");
-
-        //
-        // We can stop counting failures now.
-        //
-        count = 0;
     }
-    else
+    else if (client.state() != last_state && client.state() != MQTT_CONNECTING)
     {
-        DEBUG_LOG("failed, rc=%d, delaying for 5 seconds\n", client.state());
-        delay(5000);
+        DEBUG_LOG("MQTT connection failed, rc=%d, will retry\n", client.state());
     }
+
+    last_state = client.state();
 }
 
 
@@ -453,6 +430,25 @@ void processHTTPRequest(WiFiClient httpclient)
 
     // Read the first line of the request
     String request = httpclient.readStringUntil('\r');
+
+    //
+    // Our form is POSTed, so that its settings don't end up in the
+    // URL.  The body is parsed as it is read, a field at a time.
+    //
+    if (request.startsWith("POST "))
+    {
+        FormParser form([](const char *name, const char *value)
+        {
+            if (strcmp(name, "mq") == 0)
+                set_mq_server(value);
+        });
+
+        form.read(httpclient, FormParser::skipHeaders(httpclient));
+
+        redirectIndex(httpclient);
+        return;
+    }
+
     httpclient.flush();
 
     //
@@ -465,9 +461,10 @@ void processHTTPRequest(WiFiClient httpclient)
 
     //
     // Now we'll want to peel off any HTTP-parameters that might
-    // be present, via our utility-helper.
+    // be present, via our utility-helper.  It parses the request
+    // in place, so `request` is modified, and must outlive `url`.
     //
-    URL url(request.c_str());
+    URL url(request.begin());
 
     //
     // Change the MQ server?
@@ -476,15 +473,7 @@ void processHTTPRequest(WiFiClient httpclient)
 
     if (mq != NULL)
     {
-        // Write the data to a file.
-        write_file("/mq.addr", mq);
-
-        // Update the queue address
-        memset(mqtt_server, '\0', sizeof(mqtt_server));
-        strncpy(mqtt_server, mq, sizeof(mqtt_server) - 1);
-
-        // Force a reconnection
-        client.disconnect();
+        set_mq_server(mq);
 
         // Redirect to the server-root
         redirectIndex(httpclient);
@@ -498,6 +487,23 @@ void processHTTPRequest(WiFiClient httpclient)
 }
 
 
+//
+// Change the address of the MQ server.
+//
+void set_mq_server(const char *mq)
+{
+    // Write the data to a file.
+    write_file("/mq.addr", mq);
+
+    // Update the queue address
+    memset(mqtt_server, '\0', sizeof(mqtt_server));
+    strncpy(mqtt_server, mq, sizeof(mqtt_server) - 1);
+
+    // Force a reconnection
+    client.disconnect();
+}
+
+
 //
 // Serve a redirect to the server-root
 //
@@ -555,7 +561,7 @@ void serveHTML(WiFiClient client)
     client.print("<p>This device has the IP address <code>");
     client.print(WiFi.localIP());
     client.println("</code>, and is configured to send data to the following MQ server:</p>");
-    client.println("<form action=\"/\" method=\"GET\"><input type=\"text\" name=\"mq\" value=\"");
+    client.println("<form action=\"/\" method=\"POST\"><input type=\"text\" name=\"mq\" value=\"");
     client.print(mqtt_server);
     client.println("\"><input type=\"submit\" value=\"Update\"></form>");
     client.println("</div>");
@@ -33,6 +33,7 @@
 // Include the MQQ library and our info-dump class
 //
 #include "PubSubClient.h"
+#include "mqtt_batch.h"
 #include "info.h"
 
 
@@ -74,6 +75,15 @@ WiFiClient espClient;
 PubSubClient client(espClient);
 
 
+//
+// We measure every second, but publish the readings ten at a time.
+//
+MqttBatch batch("distance", [](const char *topic, const char *payload)
+{
+    return client.publish(topic, payload, false, 1);
+});
+
+
 //
 // Helper to dump our details.
 //
@@ -134,13 +144,10 @@ void measureDistance()
     DEBUG_LOG("Timing: %02d microseconds- Distance %02d CM\n",
               duration, last_distance);
 
-    // Format it.
-    String payload = "{\"distance\":" + String(last_distance) +
-                     ",\"microseconds\":" + String(duration) +
-                     ",\"mac\":\"" + board_info.mac() + "\"}";
-
-    // Publish it
-    client.publish("distance", payload.c_str());
+    // Add it to the batch, which is published at QoS 1.  If the broker
+    // is behind we skip this reading rather than block.
+    if (!batch.add(last_distance, duration))
+        DEBUG_LOG("Dropped reading, %d awaiting acknowledgement\n", client.inflight());
 
 
 }
@@ -274,6 +281,21 @@ void setup()
     //
     client.setServer(mqtt_server, 1883);
     client.setCallback(callback);
+
+    //
+    // A batch of ten readings doesn't fit in the default packet, and
+    // each batch is kept until it is acknowledged, so make room for one
+    // along with its topic.
+    //
+    client.setBufferSize(MQTT_BATCH_SIZE + 32);
+
+    //
+    // Each batch identifies us, and is published after ten seconds even
+    // if it isn't full, so that presence is noticed promptly.
+    //
+    String header = "\"mac\":\"" + board_info.mac() + "\"";
+    batch.setHeader(header.c_str());
+    batch.setLimits(10, MQTT_BATCH_SIZE, 10 * 1000);
 }
 
 
@@ -304,6 +326,7 @@ void loop()
     // Handle queue messages.
     //
     client.loop();
+    batch.loop();
 
     // Get the current time.
     long now = millis();
@@ -357,40 +380,35 @@ void callback(char* topic, byte* payload, unsigned int length)
 //
 // Reconnect to the pub-sub-server, if we're dropped.
 //
+// This never blocks: each call takes the next step of connecting, and
+// the library waits, longer after each failure, between attempts.
+//
 void reconnect()
 {
-    // Loop until we're reconnected
-    while (!client.connected())
-    {
-        DEBUG_LOG("Attempting to connect to MQ ..");
+    static String id = String(PROJECT_NAME) + board_info.mac();
+    static int last_state = MQTT_DISCONNECTED;
 
-        String id = PROJECT_NAME;
-        id += board_info.mac();
-
-        // Attempt to connect
-        if (client.connect(id.c_str()))
-        {
-            // We've connected
-            DEBUG_LOG("\tconnected\n");
-
-            //
-            // Dump all our local details to the meta-topic
-            //
-            client.publish("meta", board_info.to_JSON().c_str());
-
-            //
-            // Subscribe to the `meta`-topic.
-            //
-            client.subscribe("meta");
-        }
-        else
-        {
-            DEBUG_LOG("\tfailed, rc=%02d, will retry in 5 seconds.\n",
-                      client.state());
-            delay(5000);
-        }
+    if (client.connectAsync(id.c_str()))
+    {
+        // We've connected
+        DEBUG_LOG("Connected to MQ\n");
+
+        //
+        // Dump all our local details to the meta-topic
+        //
+        client.publish("meta", board_info.to_JSON().c_str());
+
+        //
+        // Subscribe to the `meta`-topic.
+        //
+        client.subscribe("meta");
+    }
+    else if (client.state() != last_state && client.state() != MQTT_CONNECTING)
+    {
+        DEBUG_LOG("Failed to connect to MQ, rc=%02d, will retry.\n", client.state());
     }
 
+    last_state = client.state();
 }
 
 
@@ -0,0 +1 @@
+../common/dns_cache.h
\ No newline at end of file
@@ -0,0 +1 @@
+../common/mqtt_batch.cpp
\ No newline at end of file
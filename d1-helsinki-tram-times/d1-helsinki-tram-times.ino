@@ -159,6 +159,7 @@ void access_point_callback(WiFiManager* myWiFiManager);
 void on_before_ntp();
 void on_after_ntp();
 void fetch_tram_times();
+void fetch_temperature();
 void handlePendingButtons();
 void on_short_click();
 void on_long_click();
@@ -212,6 +213,24 @@ state g_state = DATE;
 //
 char g_temp[10] = {'\0'};
 
+
+//
+// The fetches of the tram-times and the temperature run concurrently
+// in the background, as a group which is advanced each time around
+// our loop.  We keep track of each while it is running.
+//
+UrlFetchGroup fetches;
+UrlFetcher *tram_fetcher = NULL;
+UrlFetcher *temp_fetcher = NULL;
+
+//
+// The departures are parsed a line at a time as they arrive, so we
+// keep the partial line, and the display-row it will be written to.
+//
+char tram_buf[64] = { '\0' };
+size_t tram_len = 0;
+int tram_row = 1;
+
 //
 // Our current message, if any, which has been set by a HTTP-client
 //
@@ -595,6 +614,11 @@ void loop()
     //
     handlePendingButtons();
 
+    //
+    // Advance any fetches which are running in the background.
+    //
+    fetches.poll();
+
     //
     // Get the current time.
     //
@@ -616,8 +640,17 @@ void loop()
     // We also do it immediately the first time we're run,
     // when there is no pending time available.
     //
-    if ((strlen(screen[1]) == 0) || ((min % 2 == 0) && (sec == 0)))
+    // NOTE: The fetch doesn't block, so we record the minute we
+    // started it to avoid starting it again within the same second.
+    //
+    static int tram_min = -1;
+
+    if ((tram_fetcher == NULL) &&
+            ((strlen(screen[1]) == 0) || ((min % 2 == 0) && (sec == 0) && (min != tram_min))))
+    {
+        tram_min = min;
         fetch_tram_times();
+    }
 
     //
     // Every half hour we'll update the temperature, or initially if empty.
@@ -625,9 +658,16 @@ void loop()
     // Note that we don't bother unless we're in a mode where the
     // temperature might be displayed.
     //
-    if (g_state == TEMPERATURE || g_state == DATE_OR_TEMP)
-        if ((strlen(g_temp) == 0) || ((min % 30 == 0) && (sec == 0)))
+    static int temp_min = -1;
+
+    if ((temp_fetcher == NULL) && (g_state == TEMPERATURE || g_state == DATE_OR_TEMP))
+    {
+        if ((strlen(g_temp) == 0) || ((min % 30 == 0) && (sec == 0) && (min != temp_min)))
+        {
+            temp_min = min;
             fetch_temperature();
+        }
+    }
 
 
     //
@@ -933,8 +973,8 @@ void handlePendingButtons()
 
 
 //
-// Given a bunch of CSV, containing departures, we parse this and
-// update the screen-array.
+// Given a single line of CSV, containing a departure, we parse this and
+// update the given line of the screen-array.
 //
 // We handle CSV of the form:
 //
@@ -949,95 +989,92 @@ void handlePendingButtons()
 //
 // The name of the route is not displayed.
 //
-void update_tram_times(const char *txt)
+// Returns the display-line the next departure should be written to.
+//
+int update_tram_line(int line, const char *pch)
 {
-    char* pch = NULL;
+    //
+    // If we got a line, and it is at least ten characters
+    // long then it is probably valid.
+    //
+    // The line will be:
+    //
+    //   NN,HH:MM:SS,NAME
+    //
+    // So if we assume a two-digit ID such as "10", "7A", "4B",
+    // and the six digits of the time, then ten is a reasonable
+    // bound on the minimum-length of a valid-line.
+    //
+    if ((strlen(pch) > 10) && (line < NUM_ROWS))
+    {
 
-    int line = 1;
-    pch = strtok((char *)txt, "\r\n");
+        //
+        // Skip newlines / carriage returns
+        //
+        while (pch[0] == '\n' || pch[0] == '\r')
+            pch += 1;
 
-    while (pch != NULL)
-    {
         //
-        // If we got a line, and it is at least ten characters
-        // long then it is probably valid.
+        // Look for the first comma, which seperates
+        // the tram/bus-number and the time.
         //
-        // The line will be:
+        // We don't know how long that bus/tram ID
+        // will be.  But we'll assume <=6 characters
+        // later on.
         //
-        //   NN,HH:MM:SS,NAME
+        const char *comma = strchr(pch, ',');
+
         //
-        // So if we assume a two-digit ID such as "10", "7A", "4B",
-        // and the six digits of the time, then ten is a reasonable
-        // bound on the minimum-length of a valid-line.
+        // If we found a comma then proceed.
         //
-        if ((strlen(pch) > 10) && (line < NUM_ROWS))
+        if (comma != NULL)
         {
+            // ID of line, and time of departure.
+            char id[6] = {'\0'};
+            char tm[6] = {'\0'};
 
             //
-            // Skip newlines / carriage returns
+            // So our line-ID is contained between pch & comma.
+            //
+            // Copy it, capping it if we need to at five characters.
             //
-            while (pch[0] == '\n' || pch[0] == '\r')
-                pch += 1;
+            memset(id, '\0', sizeof(id));
+
+            strncpy(id, pch, (comma - pch) >= sizeof(id) ? sizeof(id) - 1 : (comma - pch));
 
             //
-            // Look for the first comma, which seperates
-            // the tram/bus-number and the time.
+            // Now we have comma pointing to ",HH:MM:SS,DESCRIPTION-HERE"
             //
-            // We don't know how long that bus/tram ID
-            // will be.  But we'll assume <=6 characters
-            // later on.
+            // We want to extract the time, and save that away.
             //
-            char *comma = strchr(pch, ',');
-
+            // If our time is HH:MM:SS then c + 9 will be a comma
             //
-            // If we found a comma then proceed.
+            // We will copy just the HH:MM part of the time, so five
+            // digits in total.
             //
-            if (comma != NULL)
-            {
-                // ID of line, and time of departure.
-                char id[6] = {'\0'};
-                char tm[6] = {'\0'};
-
-                //
-                // So our line-ID is contained between pch & comma.
-                //
-                // Copy it, capping it if we need to at five characters.
-                //
-                memset(id, '\0', sizeof(id));
-
-                strncpy(id, pch, (comma - pch) >= sizeof(id) ? sizeof(id) - 1 : (comma - pch));
-
-                //
-                // Now we have comma pointing to ",HH:MM:SS,DESCRIPTION-HERE"
-                //
-                // We want to extract the time, and save that away.
-                //
-                // If our time is HH:MM:SS then c + 9 will be a comma
-                //
-                // We will copy just the HH:MM part of the time, so five
-                // digits in total.
-                //
-                if (comma[9] == ',')
-                    strncpy(tm, comma + 1, 5);
-
-                snprintf(screen[line], NUM_COLS - 1, "  Line %s @ %s", id, tm);
+            if (comma[9] == ',')
+                strncpy(tm, comma + 1, 5);
 
-            }
+            snprintf(screen[line], NUM_COLS - 1, "  Line %s @ %s", id, tm);
 
-            //
-            // Bump to the next display-line
-            //
-            line += 1;
         }
 
-        pch = strtok(NULL, "\r\n");
+        //
+        // Bump to the next display-line
+        //
+        line += 1;
     }
+
+    return line;
 }
 
 
 //
 // Call a remote HTTP-service to get the current temperature.
 //
+// The fetch runs in the background, and `g_temp` is updated
+// once it has completed.
+//
 void fetch_temperature()
 {
     draw_line(NUM_ROWS - 1, "Refreshing temp ..");
@@ -1045,57 +1082,137 @@ void fetch_temperature()
     // Empty the previous value.
     memset(g_temp, '\0', sizeof(g_temp));
 
+    //
+    // If a fetch is already running we abandon it, and start afresh.
+    //
+    if (temp_fetcher != NULL)
+        fetches.remove(temp_fetcher);
+
     //
     // Make our remote call.
     //
     DEBUG_LOG("Fetching temperature-data from %s\n", temp_end_point);
-    UrlFetcher client(temp_end_point);
+    temp_fetcher = new UrlFetcher(temp_end_point);
+
+    //
+    // Both of our end-points default to the same host, so keep the
+    // connection open for the next fetch.
+    //
+    temp_fetcher->setKeepAlive(true);
+
+    //
+    // Use small TLS buffers, if the server allows it, so that we
+    // don't run out of RAM.
+    //
+    temp_fetcher->setSmallTLSBuffers(true);
+
+    //
+    // The temperature changes slowly, so allow it to be cached.
+    //
+    temp_fetcher->setCaching(true);
 
     //
-    // If that succeeded.
+    // Retry a failure a couple of times, as the next scheduled fetch
+    // is half an hour away.
     //
-    int code = client.code();
+    temp_fetcher->setRetries(3);
+    temp_fetcher->setDeadline(10000);
 
-    if (code == 200)
+    //
+    // The body is small, so we let the fetcher store it for us.
+    //
+    fetches.add(temp_fetcher, nullptr, [](UrlFetcher * client)
     {
         //
-        // Parse the returned data and process it.
+        // The group deletes the fetcher once we return.
+        //
+        temp_fetcher = NULL;
+
+        //
+        // If that succeeded.
         //
-        String body = client.body();
+        int code = client->code();
 
-        if (body.length() > 0)
+        if (code == 200)
         {
-            // "degree", "C", "terminator".
-            char deg[3] = { 0xDF, 'C', '\0' };
+            //
+            // Parse the returned data and process it.
+            //
+            String body = client->body();
+
+            if (body.length() > 0)
+            {
+                // "degree", "C", "terminator".
+                char deg[3] = { 0xDF, 'C', '\0' };
 
-            // Remove the any newline(s) that might be present in the
-            // response from the remote host.
-            body.trim();
+                // Remove the any newline(s) that might be present in the
+                // response from the remote host.
+                body.trim();
 
-            // Update `g_temp` with the returned temperature,
-            // appending "$degree C".
-            snprintf(g_temp, sizeof(g_temp) - 1, "%s%s", body.c_str(), deg);
+                // Update `g_temp` with the returned temperature,
+                // appending "$degree C".
+                snprintf(g_temp, sizeof(g_temp) - 1, "%s%s", body.c_str(), deg);
+            }
+            else
+            {
+                DEBUG_LOG("Empty body received.\n");
+                strcpy(g_temp, "TFAIL1");
+            }
         }
         else
         {
-            DEBUG_LOG("Empty body received.\n");
-            strcpy(g_temp, "TFAIL1");
+            DEBUG_LOG("HTTP-Request failed, status-Code was %03d\n", code);
+            DEBUG_LOG("Status line read: '%s'\n", client->status());
+            snprintf(g_temp, sizeof(g_temp) - 1, "TFAIL%d", code);
         }
-    }
-    else
+    });
+}
+
+
+//
+// Build the URL of our tram-data, by replacing each `__ID__` in the
+// API end-point with the ID of our stop.
+//
+// The ID comes from the user, so it is escaped, and the result is
+// truncated if it won't fit.
+//
+void tram_url(char *url, size_t size)
+{
+    const char *src = api_end_point;
+    const char *id;
+    size_t len = 0;
+
+    url[0] = '\0';
+
+    while ((id = strstr(src, "__ID__")) != NULL)
     {
-        DEBUG_LOG("HTTP-Request failed, status-Code was %03d\n", code);
-        DEBUG_LOG("Status line read: '%s'\n", client.status());
-        snprintf(g_temp, sizeof(g_temp) - 1, "TFAIL%d", code);
+        size_t prefix = id - src;
+
+        if (len + prefix >= size)
+            break;
+
+        memcpy(url + len, src, prefix);
+        len += prefix;
+
+        len += url_encode(tram_stop, url + len, size - len);
+
+        if (len >= size)
+            return;
+
+        src = id + strlen("__ID__");
     }
+
+    strncpy(url + len, src, size - len - 1);
+    url[size - 1] = '\0';
 }
 
 
 //
 // Call our HTTP-service and retrieve the tram time(s).
 //
-// This function will update the global "screen" array
-// with the departure time of the next tram(s).
+// The fetch runs in the background, and will update the global
+// "screen" array with the departure time of the next tram(s) as
+// the response arrives.
 //
 void fetch_tram_times()
 {
@@ -1104,61 +1221,138 @@ void fetch_tram_times()
     //
     draw_line(NUM_ROWS - 1, "Refreshing Trams ..");
 
+    //
+    // If a fetch is already running we abandon it, and start afresh.
+    //
+    if (tram_fetcher != NULL)
+        fetches.remove(tram_fetcher);
+
     //
     // The URL we're going to fetch, replacing `__ID__` with
     // the ID of the tram.
     //
-    String url(api_end_point);
-    url.replace("__ID__", tram_stop);
+    char url[sizeof(api_end_point) + 64];
+    tram_url(url, sizeof(url));
 
     //
     // Show what we're going to do.
     //
-    DEBUG_LOG("Fetching tram-data from %s\n", url.c_str());
+    DEBUG_LOG("Fetching tram-data from %s\n", url);
 
     //
     // Fetch the contents of the remote URL.
     //
-    UrlFetcher client(url.c_str());
+    tram_fetcher = new UrlFetcher(url);
+    tram_fetcher->setKeepAlive(true);
+    tram_fetcher->setSmallTLSBuffers(true);
+    tram_fetcher->setCaching(true);
 
     //
-    // If that succeeded.
+    // The departures compress well, and are much smaller than the
+    // decompression window, so ask for them to be compressed.
     //
-    int code = client.code();
+    tram_fetcher->setCompression(true);
 
-    if (code == 200)
-    {
+    //
+    // A brief loss of WiFi shouldn't leave the display stale until
+    // the next scheduled fetch, so retry failures - but give up in
+    // good time for that.
+    //
+    tram_fetcher->setRetries(4);
+    tram_fetcher->setDeadline(20000);
 
+    //
+    // We parse the departures as they arrive, a line at a time,
+    // rather than holding the whole response in RAM.
+    //
+    tram_len = 0;
+    tram_row = 1;
+
+    fetches.add(tram_fetcher, [](const uint8_t * data, size_t size)
+    {
         //
-        // Parse the returned data and process it.
+        // Ignore the body of error-responses.
         //
-        String body = client.body();
+        if (tram_fetcher->code() != 200)
+            return;
 
-        if (body.length() > 0)
+        for (size_t i = 0; i < size; i++)
         {
-            update_tram_times(body.c_str());
-        }
-        else
-        {
-            DEBUG_LOG("Empty response from HTTP-fetch\n");
-            strncpy(screen[1], "Empty HTTP response.", NUM_COLS - 1);
-            strncpy(screen[2], "Replacement bus?", NUM_COLS - 1);
+            char c = data[i];
+
+            if (c == '\n' || c == '\r')
+            {
+                tram_buf[tram_len] = '\0';
+                tram_row = update_tram_line(tram_row, tram_buf);
+                tram_len = 0;
+            }
+            else if (tram_len < sizeof(tram_buf) - 1)
+            {
+                tram_buf[tram_len++] = c;
+            }
         }
-    }
-    else
+    },
+    [](UrlFetcher * client)
     {
         //
-        // Log the status-code
+        // The group deletes the fetcher once we return.
         //
-        DEBUG_LOG("HTTP-Request failed, status-code was %03d\n", code);
-        strncpy(screen[1], "HTTP failure", NUM_COLS - 1);
+        tram_fetcher = NULL;
+
+        DEBUG_LOG("TLS sessions: %lu resumed, %lu full handshakes\n",
+                  UrlFetcher::sessionHits(), UrlFetcher::sessionMisses());
+        DEBUG_LOG("TLS buffers: %d receive, %d send\n",
+                  client->tlsReceiveBuffer(), client->tlsSendBuffer());
+        DEBUG_LOG("HTTP cache: %lu hits, %lu revalidated, %lu misses\n",
+                  UrlFetcher::cacheHits(), UrlFetcher::cacheRevalidations(),
+                  UrlFetcher::cacheMisses());
+
+        const UrlFetcherTimings &t = client->timings();
+        DEBUG_LOG("HTTP timings: dns %lu, connect %lu, tls %lu, ttfb %lu, body %lu, total %lu ms, %lu bytes\n",
+                  t.dns, t.connect, t.tls, t.ttfb, t.body, t.total, t.bytes);
 
         //
-        // Log the status-line
+        // If that succeeded.
         //
-        DEBUG_LOG("Status line read: '%s'\n", client.status());
-        strncpy(screen[2], client.status(), NUM_COLS - 1);
-    }
+        int code = client->code();
+
+        if (code == 200)
+        {
+            //
+            // Process any final line which lacked a trailing newline.
+            //
+            if (tram_len > 0)
+            {
+                tram_buf[tram_len] = '\0';
+                update_tram_line(tram_row, tram_buf);
+                tram_len = 0;
+            }
+
+            if (! client->complete())
+                DEBUG_LOG("Truncated response from HTTP-fetch\n");
+
+            if (client->received() == 0)
+            {
+                DEBUG_LOG("Empty response from HTTP-fetch\n");
+                strncpy(screen[1], "Empty HTTP response.", NUM_COLS - 1);
+                strncpy(screen[2], "Replacement bus?", NUM_COLS - 1);
+            }
+        }
+        else
+        {
+            //
+            // Log the status-code
+            //
+            DEBUG_LOG("HTTP-Request failed, status-code was %03d\n", code);
+            strncpy(screen[1], "HTTP failure", NUM_COLS - 1);
+
+            //
+            // Log the status-line
+            //
+            DEBUG_LOG("Status line read: '%s'\n", client->status());
+            strncpy(screen[2], client->status(), NUM_COLS - 1);
+        }
+    });
 }
 
 
@@ -1428,6 +1622,28 @@ void serveHTML(WiFiClient client)
     client.printf("<p>%d day%s, %d hours, %d minutes, %d seconds.</p>", days, days == 1 ? "" : "s", hours, mins, secs);
     client.print("</blockquote>");
 
+    client.println("<p>Fetch timings (min/avg/max ms):</p><blockquote>");
+    client.println("<table class=\"table table-striped table-hover table-condensed table-bordered\">");
+    client.println("<tr><th>Host</th><th>Fetches</th><th>DNS</th><th>Connect</th><th>TLS</th><th>First byte</th><th>Body</th><th>Total</th></tr>");
+
+    const UrlFetcherHostStats *stats;
+
+    for (int i = 0; (stats = UrlFetcher::hostStats(i)) != NULL; i++)
+    {
+        const UrlFetcherRange *ranges[] = { &stats->dns, &stats->connect, &stats->tls,
+                                            &stats->ttfb, &stats->body, &stats->total
+                                          };
+
+        client.printf("<tr><td>%s</td><td>%lu</td>", stats->host, stats->fetches);
+
+        for (int j = 0; j < 6; j++)
+            client.printf("<td>%lu/%lu/%lu</td>", ranges[j]->min, ranges[j]->avg, ranges[j]->max);
+
+        client.println("</tr>");
+    }
+
+    client.println("</table></blockquote>");
+
 
     client.println("</blockquote>");
     client.println("</div>");
@@ -1545,9 +1761,10 @@ void processHTTPRequest(WiFiClient client)
 
     //
     // Now we'll want to peel off any HTTP-parameters that might
-    // be present, via our utility-helper.
+    // be present, via our utility-helper.  It parses the request
+    // in place, so `request` is modified, and must outlive `url`.
     //
-    URL url(request.c_str());
+    URL url(request.begin());
 
     //
     // Does the user want to change the backlight?
@@ -0,0 +1 @@
+../common/dns_cache.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../common/inflater.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../common/inflater.h
\ No newline at end of file
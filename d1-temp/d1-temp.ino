@@ -131,8 +131,10 @@ void measureDHT()
                          ",\"humidity\":" + String(DHT.humidity) +
                          ",\"mac\":\"" + board_info.mac() + "\"}";
 
-        // Publish it
-        client.publish("temperature", payload.c_str());
+        // Publish it, at QoS 1 so that it is resent until the broker
+        // acknowledges it.
+        if (!client.publish("temperature", payload.c_str(), false, 1))
+            DEBUG_LOG("Dropped reading, %d awaiting acknowledgement\n", client.inflight());
 
         // Record so that the HTTP-server can serve it.
         last_temperature = DHT.temperature;
@@ -387,40 +389,35 @@ void callback(char* topic, byte* payload, unsigned int length)
 //
 // Reconnect to the pub-sub-server, if we're dropped.
 //
+// This never blocks: each call takes the next step of connecting, and
+// the library waits, longer after each failure, between attempts.
+//
 void reconnect()
 {
-    // Loop until we're reconnected
-    while (!client.connected())
+    static String id = String(PROJECT_NAME) + board_info.mac();
+    static int last_state = MQTT_DISCONNECTED;
+
+    if (client.connectAsync(id.c_str()))
     {
-        DEBUG_LOG("Attempting to connect to MQ ..");
+        // We've connected
+        DEBUG_LOG("Connected to MQ\n");
 
-        String id = PROJECT_NAME;
-        id += board_info.mac();
+        //
+        // Dump all our local details to the meta-topic
+        //
+        client.publish("meta", board_info.to_JSON().c_str());
 
-        // Attempt to connect
-        if (client.connect(id.c_str()))
-        {
-            // We've connected
-            DEBUG_LOG("\tconnected\n");
-
-            //
-            // Dump all our local details to the meta-topic
-            //
-            client.publish("meta", board_info.to_JSON().c_str());
-
-            //
-            // Subscribe to the `meta`-topic.
-            //
-            client.subscribe("meta");
-        }
-        else
-        {
-            DEBUG_LOG("\tfailed, rc=%02d, will retry in 5 seconds.\n",
-                      client.state());
-            delay(5000);
-        }
+        //
+        // Subscribe to the `meta`-topic.
+        //
+        client.subscribe("meta");
+    }
+    else if (client.state() != last_state && client.state() != MQTT_CONNECTING)
+    {
+        DEBUG_LOG("Failed to connect to MQ, rc=%02d, will retry.\n", client.state());
     }
 
+    last_state = client.state();
 }
 
 
@@ -1,6 +1,7 @@
 #include <ESP8266WiFi.h>
 #include <ArduinoOTA.h>
 #include <ESP8266HTTPClient.h>
+#include <FS.h>
 
 //
 // The access-point functionality
@@ -17,12 +18,27 @@
 // Include the MQQ library, and define our server.
 //
 #include "PubSubClient.h"
+#include "mqtt_queue.h"
+#include "mqtt_batch.h"
 #include "info.h"
 const char* mqtt_server = "192.168.10.64";
 WiFiClient espClient;
 PubSubClient client(espClient);
 info board_info;
 
+//
+// Readings we couldn't publish are kept in flash until we can.
+//
+MqttQueue queue(client);
+
+//
+// Readings are published several at a time, through the queue.
+//
+MqttBatch batch("water", [](const char *topic, const char *payload)
+{
+    return queue.publish(topic, payload);
+});
+
 
 
 //
@@ -145,6 +161,24 @@ void setup() //
     client.setServer(mqtt_server, 1883);
     client.setCallback(callback);
 
+    //
+    // Open the queue of unsent readings, which survives a reboot.
+    //
+    SPIFFS.begin();
+
+    if (!queue.begin())
+        DEBUG_LOG("Failed to open the MQTT queue\n");
+    else
+        DEBUG_LOG("%lu readings waiting to be published\n", queue.pending());
+
+    //
+    // Each batch of readings identifies us, and must fit in a record of
+    // the queue, and in the client's default buffer.
+    //
+    String header = "\"mac\":\"" + board_info.mac() + "\"";
+    batch.setHeader(header.c_str());
+    batch.setLimits(MQTT_BATCH_COUNT, 100, MQTT_BATCH_AGE);
+
 }
 
 
@@ -167,9 +201,12 @@ void loop()
         reconnect();
 
     //
-    // Handle queue messages.
+    // Handle queue messages, and send anything we stored while we were
+    // disconnected.
     //
     client.loop();
+    queue.loop();
+    batch.loop();
 
     //
     // Get the current time.
@@ -210,20 +247,20 @@ void measure_water()
     //
     int Calc = (NbTopsFan * 60 / 7.5);
 
-    //
-    // The JSON we publish.
-    //
-    String payload = "{\"flow\":" + String(Calc) + ",\"mac\":\"" + board_info.mac() + "\"}";
-
     //
     // Log it
     //
-    DEBUG_LOG("Sending data to MQ: %s\n", payload.c_str());
+    DEBUG_LOG("Flow: %d\n", Calc);
 
     //
-    // Publish it to the bus
+    // Add it to the batch, which is published to the bus once it is
+    // full, or a minute old.
     //
-    client.publish("water", payload.c_str());
+    // If we're not connected, or the broker is behind, it is stored in
+    // flash and sent later, so that we don't leave gaps in the record.
+    //
+    if (!batch.add(Calc))
+        DEBUG_LOG("Failed to store reading\n");
 }
 
 
@@ -254,39 +291,33 @@ void callback(char* topic, byte* payload, unsigned int length)
 //
 // Reconnect to the pub-sub-server, if we're dropped.
 //
+// This never blocks: each call takes the next step of connecting, and
+// the library waits, longer after each failure, between attempts.
+//
 void reconnect()
 {
-    // Loop until we're reconnected
-    while (!client.connected())
+    static String id = String(PROJECT_NAME) + board_info.mac();
+    static int last_state = MQTT_DISCONNECTED;
+
+    if (client.connectAsync(id.c_str()))
+    {
+        // We've connected
+        DEBUG_LOG("MQTT connected\n");
+
+        //
+        // Dump all our local details to the meta-topic
+        //
+        client.publish("meta", board_info.to_JSON().c_str());
+
+        //
+        // Subscribe to the `meta`-topic.
+        //
+        client.subscribe("meta");
+    }
+    else if (client.state() != last_state && client.state() != MQTT_CONNECTING)
     {
-        DEBUG_LOG("Attempting MQTT connection...");
-
-        String id = PROJECT_NAME;
-        id += board_info.mac();
-
-        // Attempt to connect
-        if (client.connect(id.c_str()))
-        {
-            // We've connected
-            DEBUG_LOG(" connected\n");
-
-            //
-            // Dump all our local details to the meta-topic
-            //
-            client.publish("meta", board_info.to_JSON().c_str());
-
-            //
-            // Subscribe to the `meta`-topic.
-            //
-            client.subscribe("meta");
-        }
-        else
-        {
-            DEBUG_LOG(" failed, rc=%d - will retry in five seconds\n", (client.state()));
-
-            // Wait 5 seconds before retrying
-            delay(5000);
-        }
+        DEBUG_LOG("MQTT connection failed, rc=%d, will retry\n", client.state());
     }
 
+    last_state = client.state();
 }
@@ -0,0 +1 @@
+../common/mqtt_batch.h
\ No newline at end of file
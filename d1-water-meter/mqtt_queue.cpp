@@ -0,0 +1 @@
+../common/mqtt_queue.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../common/mqtt_queue.h
\ No newline at end of file
@@ -460,9 +460,10 @@ void processHTTPRequest(WiFiClient client)
 
     //
     // Now we'll want to peel off any HTTP-parameters that might
-    // be present, via our utility-helper.
+    // be present, via our utility-helper.  It parses the request
+    // in place, so `request` is modified, and must outlive `url`.
     //
-    URL url(request.c_str());
+    URL url(request.begin());
 
     //
     // Does the user want to tune directly?
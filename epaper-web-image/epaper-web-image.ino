@@ -52,6 +52,12 @@
 #include <ESP8266HTTPClient.h>
 
 
+//
+// For fetching the image-data.
+//
+#include "url_fetcher.h"
+
+
 //
 // Debug messages over the serial console.
 //
@@ -105,165 +111,99 @@ void access_point_callback(WiFiManager* myWiFiManager)
 
 
 //
-// Fetch and display the image specified at the given URL
+// Draw a single line of image-data, of the form "x,y,X,Y".
 //
-void display_url(const char * m_path)
+void draw_image_line(char *txt)
 {
     //
-    // Clear the display.
+    // The line will be of the form "x,y,X,Y", so we
+    // need to parse that into four integers, and then
+    // draw the appropriate line on our display.
     //
-    display.fillScreen(GxEPD_WHITE);
-    display.setTextColor(GxEPD_BLACK);
+    int line[5] = { 0 };
+    int i = 0;
+
 
     //
-    // The host we're going to fetch from.
+    // Parse into values.
     //
-    char m_host[] = "plain.steve.fi";
+    char* ptr = strtok(txt, ",");
 
-    char m_tmp[50] = { '\0' };
-    memset(m_tmp, '\0', sizeof(m_tmp));
+    while (ptr != NULL && i < 4)
+    {
+        // create next part
+        line[i] = atoi(ptr);
+        i++;
+        ptr = strtok(NULL, ",");
+    }
 
-    /*
-     * Create a HTTP client-object.
-     */
-    WiFiClient m_client;
-    int port = 80;
 
     //
-    // Keep track of where we are.
+    // Draw the line.
     //
-    bool finishedHeaders = false;
-    bool currentLineIsBlank = true;
-    String m_body = "";
-    long now;
+    display.drawLine(line[1], line[0], line[3], line[2], GxEPD_BLACK);
+}
 
-    DEBUG_LOG("About to make the connection to '%s:%d' for %s\n", m_host, port, m_path);
 
+//
+// Fetch and display the image specified at the given URL
+//
+void display_url(const char * m_path)
+{
     //
-    // Connect to the remote host, and send the HTTP request.
+    // Clear the display.
     //
-    if (!m_client.connect(m_host, port))
-    {
-        DEBUG_LOG("Failed to connect");
-        return;
-    }
-
-    DEBUG_LOG("Making HTTP-request\n");
+    display.fillScreen(GxEPD_WHITE);
+    display.setTextColor(GxEPD_BLACK);
 
-    m_client.print("GET ");
-    m_client.print(m_path);
-    m_client.println(" HTTP/1.0");
-    m_client.print("Host: ");
-    m_client.println(m_host);
-    m_client.println("User-Agent: epaper-web-image/1.0");
-    m_client.println("Connection: close");
-    m_client.println("");
+    //
+    // The host we're going to fetch from.
+    //
+    String url("http://plain.steve.fi");
+    url += m_path;
 
-    DEBUG_LOG("Made HTTP-request\n");
+    DEBUG_LOG("About to fetch %s\n", url.c_str());
 
-    now = millis();
+    UrlFetcher client(url.c_str());
+    client.setAgent("epaper-web-image/1.0");
 
     //
-    // Test for timeout waiting for the first byte.
+    // We don't want to store the whole damn response in a string,
+    // because that would eat all our RAM.
     //
-    while (m_client.available() == 0)
-    {
-        if (millis() - now > 15000)
-        {
-            Serial.println(">>> Client Timeout !");
-            m_client.stop();
-            return;
-        }
-    }
-
+    // Instead we collect each line as it arrives, and once we find
+    // a newline we process that input, then we keep reading more.
+    //
+    char m_tmp[50] = { '\0' };
+    size_t len = 0;
     int l = 0;
 
-    //
-    // Now we hope we'll have smooth-sailing, and we'll
-    // read a single character until we've got it all
-    //
-    while (m_client.connected())
+    int code = client.stream([&](const uint8_t * data, size_t size)
     {
-      if(m_client.available())
-      {
-        char c = m_client.read();
-
-        if (finishedHeaders)
+        for (size_t i = 0; i < size; i++)
         {
-            //
-            // Here we're reading the body of the response.
-            //
-            // We keep appending characters, but we don't want to
-            // store the whole damn response in a string, because
-            // that would eat all our RAM.
-            //
-            // Instead we read each character until we find a newline
-            //
-            // Once we find a newline we process that input, then
-            // we keep reading more.
-            //
-            if (c == '\n' && strlen(m_tmp) > 5)
-            {
-                l += 1;
-
-                //
-                // Here we've read a complete line.
-                //
-                // The line will be of the form "x,y,X,Y", so we
-                // need to parse that into four integers, and then
-                // draw the appropriate line on our display.
-                //
-                int line[5] = { 0 };
-                int i = 0;
-
+            char c = data[i];
 
-                //
-                // Parse into values.
-                //
-                char* ptr = strtok(m_tmp, ",");
+            if (c == '\n')
+            {
+                m_tmp[len] = '\0';
 
-                while (ptr != NULL && i < 4)
+                if (len > 5)
                 {
-                    // create next part
-                    line[i] = atoi(ptr);
-                    i++;
-                    ptr = strtok(NULL, ",");
+                    draw_image_line(m_tmp);
+                    l += 1;
                 }
 
-
-                //
-                // Draw the line.
-                //
-                display.drawLine(line[1], line[0], line[3], line[2], GxEPD_BLACK);
-
-                //
-                // Now we nuke the memory so that we can read
-                // another line.
-                //
-                memset(m_tmp, '\0', sizeof(m_tmp));
+                len = 0;
             }
-            else
+            else if (len < sizeof(m_tmp) - 1)
             {
-                // TODO - buffer-overflow.
-                m_tmp[strlen(m_tmp)] = c;
+                m_tmp[len++] = c;
             }
         }
-        else
-        {
-            if (currentLineIsBlank && c == '\n')
-                finishedHeaders = true;
-        }
-
-        if (c == '\n')
-            currentLineIsBlank = true;
-        else if (c != '\r')
-            currentLineIsBlank = false;
-
-      }
-    }
+    });
 
-    DEBUG_LOG("Nothing more is available - terminating");
-    m_client.stop();
+    DEBUG_LOG("Fetch complete, status-code was %03d\n", code);
     DEBUG_LOG("Processed %d lines", l);
 
 
@@ -0,0 +1 @@
+../common/url_fetcher.cpp
\ No newline at end of file
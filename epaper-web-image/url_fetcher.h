@@ -0,0 +1 @@
+../common/url_fetcher.h
\ No newline at end of file